@@ -12,12 +12,15 @@ static struct Config config = {
 	.background_color = "#000000",
 	.foreground_color = "#FFFFFF",
 	.description_color = "#555753",
+	.match_color = "#FCE94F",
 	.hoverbackground_color = "#121212",
 	.hoverforeground_color = "#FFFFFF",
 	.hoverdescription_color = "#555753",
+	.hovermatch_color = "#FCE94F",
 	.selbackground_color = "#3465A4",
 	.selforeground_color = "#FFFFFF",
 	.seldescription_color = "#C5C8C6",
+	.selmatch_color = "#FCE94F",
 	.separator_color = "#555753",
 	.border_color = "#555753",
 
@@ -32,6 +35,18 @@ static struct Config config = {
 	.histfile = NULL,       /* keep NULL to set history via command-line options */
 	.histsize = 15,         /* history size */
 
+	/* usage of the completion items, to list the most frecently chosen ones first */
+	.usagefile = NULL,      /* keep NULL to set usage file via command-line options */
+
+	/* items */
+	.itemfile = NULL,       /* keep NULL to read items from stdin */
+
 	/* if nonzero, indent items on dropdown menu (as in dmenu) */
-	.indent = 0
+	.indent = 0,
+
+	/* if nonzero, words also begin at capital letters inside words (as in "fooBar" and "XMLParser") */
+	.camelcase = 0,
+
+	/* if nonzero, -i also ignores diacritics (as in "é" and "e") */
+	.stripaccents = 0
 };
@@ -3,13 +3,28 @@
 #include <err.h>
 #include <errno.h>
 #include <ctype.h>
+#include <dirent.h>
 #include <limits.h>
 #include <locale.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <wctype.h>
 #include <glob.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <X11/Xlib.h>
 #include <X11/Xatom.h>
 #include <X11/Xutil.h>
@@ -18,8 +33,13 @@
 #include <X11/Xft/Xft.h>
 #include <X11/cursorfont.h>
 #include <X11/extensions/Xinerama.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "xprompt.h"
 
+extern char **environ;
+
 /* X stuff */
 static Display *dpy;
 static int screen;
@@ -37,11 +57,14 @@ static Atom atoms[AtomLast];
 /* flags */
 static int aflag = 0;   /* whether to keep looking for arguments to complete */
 static int cflag = 0;   /* whether to always show autocomplete */
+static int Dflag = 0;   /* whether to run as a daemon */
 static int dflag = 0;   /* whether to show only item descriptions */
+static int Fflag = 0;   /* whether to match items fuzzily */
 static int fflag = 0;   /* whether to enable filename completion */
 static int hflag = 0;   /* whether to enable history */
 static int mflag = 0;   /* whether the user specified a monitor */
 static int pflag = 0;   /* whether to enable password mode */
+static int rflag = 0;   /* whether to read items while running */
 static int sflag = 0;   /* whether a single enter or esc closes xprompt*/
 static int wflag = 0;   /* whether to enable embeded prompt */
 
@@ -51,9 +74,45 @@ static enum Ctrl ctrl[CaseLast][NLETTERS];
 /* comparison function */
 static int (*fstrncmp)(const char *, const char *, size_t) = strncmp;
 
+/* whether each byte is a word delimiter, built from config.worddelimiters */
+static char delimiters[256];
+
 /* whether xprompt is in file completion */
 static int filecomp = 0;
 
+/* whether matching gives up when a key is pressed meanwhile, and whether it gave up */
+static int cancellable = 0;
+static int cancelled = 0;
+
+/* file of items mapped into memory */
+static char *itemmap = NULL;
+static size_t itemmapsize = 0;
+
+/* items read from stdin */
+static char *itembuf = NULL;
+
+/* usage of the completion items */
+static struct Usage usefile = {.fd = -1, .map = NULL, .mapsize = 0, .nrecords = 0};
+
+/* threads matching long lists of items, started the first time one is matched */
+static struct Pool pool = {.started = 0, .nthreads = 0};
+
+/* items kept by the daemon between sessions */
+static struct Keep keep = {.rootitem = NULL, .input = NULL, .buf = NULL, .map = NULL};
+
+/* items read from stdin while running, and the incomplete line after them */
+static struct Item *readroot = NULL;
+static struct Item *readprev = NULL;
+static unsigned readlevel = 0;
+static char *readbuf = NULL;
+static size_t readsize = 0;
+static size_t readlen = 0;
+static struct Intern readstrings = {.strings = NULL, .size = 0, .nstrings = 0};
+
+/* arenas for the item tree and for the list of file completions */
+static struct Arena itemarena = {.chunk = NULL};
+static struct Arena filearena = {.chunk = NULL};
+
 /* Include defaults */
 #include "config.h"
 
@@ -61,8 +120,9 @@ static int filecomp = 0;
 static void
 usage(void)
 {
-	(void)fprintf(stderr, "usage: xprompt [-acdfips] [-G gravity] [-g geometry] [-h file]\n"
-	                      "               [-m monitor] [-w windowid] [prompt]\n");
+	(void)fprintf(stderr, "usage: xprompt [-acdFfiprs] [-G gravity] [-g geometry] [-h file]\n"
+	                      "               [-I file] [-m monitor] [-u file] [-w windowid] [prompt]\n"
+	                      "       xprompt -D\n");
 	exit(1);
 }
 
@@ -99,6 +159,142 @@ emalloc(size_t size)
 	return p;
 }
 
+/* allocate size bytes aligned to align bytes from the arena */
+static void *
+arenaalloc(struct Arena *arena, size_t size, size_t align)
+{
+	struct Chunk *chunk;
+	size_t off;
+
+	off = 0;
+	if ((chunk = arena->chunk) != NULL)
+		off = (chunk->used + align - 1) & ~(align - 1);
+	if (chunk == NULL || off + size > chunk->size) {
+		chunk = emalloc(offsetof(struct Chunk, data) + MAX(size, ARENASIZ));
+		chunk->size = MAX(size, ARENASIZ);
+		chunk->next = arena->chunk;
+		arena->chunk = chunk;
+		off = 0;
+	}
+	chunk->used = off + size;
+	return chunk->data + off;
+}
+
+/* copy n bytes of s into a nul-terminated string allocated from the arena */
+static char *
+arenastrndup(struct Arena *arena, const char *s, size_t n)
+{
+	char *t;
+
+	t = arenaalloc(arena, n + 1, 1);
+	memcpy(t, s, n);
+	t[n] = '\0';
+	return t;
+}
+
+/* move the memory allocated from the arena src into the arena dst */
+static void
+mergearena(struct Arena *dst, struct Arena *src)
+{
+	struct Chunk *chunk;
+
+	if ((chunk = src->chunk) == NULL)
+		return;
+	while (chunk->next != NULL)
+		chunk = chunk->next;
+	chunk->next = dst->chunk;
+	dst->chunk = src->chunk;
+	src->chunk = NULL;
+}
+
+/* free all the memory allocated from the arena */
+static void
+cleanarena(struct Arena *arena)
+{
+	struct Chunk *chunk, *tmp;
+
+	chunk = arena->chunk;
+	while (chunk != NULL) {
+		tmp = chunk;
+		chunk = chunk->next;
+		free(tmp);
+	}
+	arena->chunk = NULL;
+}
+
+/* hash len bytes of s into h; len must be a multiple of 8, except on the last call */
+static uint64_t
+hashbytes(uint64_t h, const char *s, size_t len)
+{
+	uint64_t w;
+
+	for (; len >= sizeof w; s += sizeof w, len -= sizeof w) {
+		memcpy(&w, s, sizeof w);
+		h = (h ^ w) * HASHMUL;
+		h ^= h >> 32;
+	}
+	if (len > 0) {
+		w = 0;
+		memcpy(&w, s, len);
+		h = (h ^ w) * HASHMUL;
+		h ^= h >> 32;
+	}
+	return h;
+}
+
+/* look up the interned string equal to the len bytes of s; an entry not found yet is added with s set to NULL */
+static struct String *
+intern(struct Intern *tab, const char *s, size_t len)
+{
+	struct String *strings;
+	uint64_t h;
+	size_t i, j, size;
+
+	/* keep the table at most three quarters full */
+	if ((tab->nstrings + 1) * 4 > tab->size * 3) {
+		strings = tab->strings;
+		size = tab->size;
+		tab->size = size ? size * 2 : INTERNSIZ;
+		tab->strings = ecalloc(tab->size, sizeof *tab->strings);
+		for (i = 0; i < size; i++) {
+			if (strings[i].s == NULL)
+				continue;
+			j = strings[i].hash & (tab->size - 1);
+			while (tab->strings[j].s != NULL)
+				j = (j + 1) & (tab->size - 1);
+			tab->strings[j] = strings[i];
+		}
+		free(strings);
+	}
+
+	h = hashbytes(HASHSEED, s, len);
+	for (i = h & (tab->size - 1); tab->strings[i].s != NULL; i = (i + 1) & (tab->size - 1))
+		if (tab->strings[i].hash == h && tab->strings[i].len == len &&
+		    memcmp(tab->strings[i].s, s, len) == 0)
+			return &tab->strings[i];
+	tab->strings[i].hash = h;
+	tab->strings[i].len = len;
+	tab->nstrings++;
+	return &tab->strings[i];
+}
+
+/* free the table of interned strings, but not the strings */
+static void
+cleanintern(struct Intern *tab)
+{
+	free(tab->strings);
+	tab->strings = NULL;
+	tab->size = tab->nstrings = 0;
+}
+
+/* show usage of xprompt-compile */
+static void
+compileusage(void)
+{
+	(void)fprintf(stderr, "usage: xprompt-compile < items > image\n");
+	exit(1);
+}
+
 /* get configuration from X resources */
 static void
 getresources(void)
@@ -121,18 +317,24 @@ getresources(void)
 		config.foreground_color = xval.addr;
 	if (XrmGetResource(xdb, "xprompt.description", "*", &type, &xval) == True)
 		config.description_color = xval.addr;
+	if (XrmGetResource(xdb, "xprompt.match", "*", &type, &xval) == True)
+		config.match_color = xval.addr;
 	if (XrmGetResource(xdb, "xprompt.hoverbackground", "*", &type, &xval) == True)
 		config.hoverbackground_color = xval.addr;
 	if (XrmGetResource(xdb, "xprompt.hoverforeground", "*", &type, &xval) == True)
 		config.hoverforeground_color = xval.addr;
 	if (XrmGetResource(xdb, "xprompt.hoverdescription", "*", &type, &xval) == True)
 		config.hoverdescription_color = xval.addr;
+	if (XrmGetResource(xdb, "xprompt.hovermatch", "*", &type, &xval) == True)
+		config.hovermatch_color = xval.addr;
 	if (XrmGetResource(xdb, "xprompt.selbackground", "*", &type, &xval) == True)
 		config.selbackground_color = xval.addr;
 	if (XrmGetResource(xdb, "xprompt.selforeground", "*", &type, &xval) == True)
 		config.selforeground_color = xval.addr;
 	if (XrmGetResource(xdb, "xprompt.seldescription", "*", &type, &xval) == True)
 		config.seldescription_color = xval.addr;
+	if (XrmGetResource(xdb, "xprompt.selmatch", "*", &type, &xval) == True)
+		config.selmatch_color = xval.addr;
 	if (XrmGetResource(xdb, "xprompt.separator", "*", &type, &xval) == True)
 		config.separator_color = xval.addr;
 	if (XrmGetResource(xdb, "xprompt.border", "*", &type, &xval) == True)
@@ -155,12 +357,43 @@ getenvironment(void)
 		config.histfile = s;
 	if ((s = getenv("XPROMPTHISTSIZE")) != NULL)
 		config.histsize = strtoul(s, NULL, 10);
+	if ((s = getenv("XPROMPTUSAGEFILE")) != NULL)
+		config.usagefile = s;
 	if ((s = getenv("XPROMPTCTRL")) != NULL)
 		config.xpromptctrl = s;
 	if ((s = getenv("WORDDELIMITERS")) != NULL)
 		config.worddelimiters = s;
 }
 
+/* build the table of word delimiters, so scanning a word does not scan config.worddelimiters for each byte */
+static void
+initdelimiters(void)
+{
+	const char *s;
+
+	memset(delimiters, 0, sizeof delimiters);
+	delimiters['\0'] = 1;          /* as strchr(3) finds the terminating nul */
+	for (s = config.worddelimiters; *s != '\0'; s++)
+		delimiters[(unsigned char)*s] = 1;
+}
+
+/* check whether c is a word delimiter */
+static int
+isdelim(int c)
+{
+	return delimiters[(unsigned char)c];
+}
+
+/* skip the word delimiters (if delim is nonzero) or the other bytes from s to end; return where they end */
+static const char *
+skipdelim(const char *s, const char *end, int delim)
+{
+	delim = (delim != 0);
+	while (s < end && delimiters[(unsigned char)*s] == delim)
+		s++;
+	return s;
+}
+
 /* get configuration from command-line options, return non-option argument */
 static char *
 getoptions(int argc, char *argv[], Window *win_ret)
@@ -168,7 +401,7 @@ getoptions(int argc, char *argv[], Window *win_ret)
 	int ch;
 
 	/* get options */
-	while ((ch = getopt(argc, argv, "acdfG:g:h:im:psw:")) != -1) {
+	while ((ch = getopt(argc, argv, "acdFfG:g:h:I:im:prsu:w:")) != -1) {
 		switch (ch) {
 		case 'a':
 			aflag = 1;
@@ -179,6 +412,9 @@ getoptions(int argc, char *argv[], Window *win_ret)
 		case 'd':
 			dflag = 1;
 			break;
+		case 'F':
+			Fflag = 1;
+			break;
 		case 'f':
 			fflag = 1;
 			break;
@@ -191,6 +427,9 @@ getoptions(int argc, char *argv[], Window *win_ret)
 		case 'h':
 			config.histfile = optarg;
 			break;
+		case 'I':
+			config.itemfile = optarg;
+			break;
 		case 'i':
 			fstrncmp = strncasecmp;
 			break;
@@ -201,9 +440,15 @@ getoptions(int argc, char *argv[], Window *win_ret)
 		case 'p':
 			pflag = 1;
 			break;
+		case 'r':
+			rflag = 1;
+			break;
 		case 's':
 			sflag = 1;
 			break;
+		case 'u':
+			config.usagefile = optarg;
+			break;
 		case 'w':
 			wflag = 1;
 			*win_ret = strtoul(optarg, NULL, 0);
@@ -358,12 +603,15 @@ initdc(void)
 	ealloccolor(config.hoverbackground_color,   &dc.hover[ColorBG]);
 	ealloccolor(config.hoverforeground_color,   &dc.hover[ColorFG]);
 	ealloccolor(config.hoverdescription_color,  &dc.hover[ColorCM]);
+	ealloccolor(config.hovermatch_color,        &dc.hover[ColorHL]);
 	ealloccolor(config.background_color,        &dc.normal[ColorBG]);
 	ealloccolor(config.foreground_color,        &dc.normal[ColorFG]);
 	ealloccolor(config.description_color,       &dc.normal[ColorCM]);
+	ealloccolor(config.match_color,             &dc.normal[ColorHL]);
 	ealloccolor(config.selbackground_color,     &dc.selected[ColorBG]);
 	ealloccolor(config.selforeground_color,     &dc.selected[ColorFG]);
 	ealloccolor(config.seldescription_color,    &dc.selected[ColorCM]);
+	ealloccolor(config.selmatch_color,          &dc.selected[ColorHL]);
 	ealloccolor(config.separator_color,         &dc.separator);
 	ealloccolor(config.border_color,            &dc.border);
 
@@ -406,40 +654,266 @@ initctrl(void)
 	}
 }
 
-/* allocate a completion item */
+/* get the string of the item that is matched, and its length */
+static const char *
+itemstring(struct Item *item, size_t *len)
+{
+	if (dflag && item->description) {
+		*len = item->desclen;
+		return item->description;
+	}
+	*len = item->textlen;
+	return item->text;
+}
+
+/* get the string of the item that text is matched against: its key, if it has one */
+static const char *
+matchstring(struct Item *item, size_t *len)
+{
+	if (item->key != NULL) {
+		*len = item->keylen;
+		return item->key;
+	}
+	return itemstring(item, len);
+}
+
+/* write the n bytes at b, that come from the character at offset from, into key at offset k; return the new offset */
+static size_t
+putkey(char *key, uint32_t *map, size_t k, const char *b, size_t n, size_t from)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++, k++) {
+		if (key != NULL)
+			key[k] = b[i];
+		if (map != NULL)
+			map[k] = from;
+	}
+	return k;
+}
+
+/*
+ * Normalize the len bytes at s into key, if it is not NULL, and return
+ * the length of the normalized string.  For each byte of key, map (if it
+ * is not NULL) gets the offset in s of the character it comes from.
+ *
+ * Characters are converted to lowercase, ß is converted to ss, and, if
+ * config.stripaccents is set, the diacritics of the latin letters (from
+ * U+00C0 to U+017F) and the combining diacritics are removed, as in NFKD.
+ * Bytes that are not valid UTF-8 are kept as they are.
+ */
+static size_t
+normalize(const char *s, size_t len, char *key, uint32_t *map)
+{
+	/* letters from U+00C0 to U+017F without diacritics, or '.' */
+	static const char *accents =
+		"aaaaaa.ceeeeiiii.nooooo..uuuuy.."
+		"aaaaaa.ceeeeiiii.nooooo..uuuuy.y"
+		"aaaaaaccccccccdd..eeeeeeeeeegggg"
+		"gggghh..iiiiiiiii...jjkk.llllll."
+		"...nnnnnn...oooooo..rrrrrrssssss"
+		"sstttt..uuuuuuuuuuuuwwyyyzzzzzz.";
+	unsigned char c;
+	char b[4];
+	size_t i, j, k, n;
+	wint_t wc;
+
+	for (i = k = 0; i < len; i += n) {
+		c = s[i];
+		n = 1;
+		if (c < 0x80) {
+			b[0] = BETWEEN(c, 'A', 'Z') ? c + 'a' - 'A' : c;
+			k = putkey(key, map, k, b, 1, i);
+			continue;
+		}
+
+		/* decode the character, or keep the byte if it is not valid */
+		n = (c >= 0xF8) ? 0 : (c >= 0xF0) ? 4 : (c >= 0xE0) ? 3 : (c >= 0xC0) ? 2 : 0;
+		wc = c & (0x3F >> (n > 0 ? n - 1 : 0));
+		for (j = 1; j < n && i + j < len && ((unsigned char)s[i + j] & 0xC0) == 0x80; j++)
+			wc = (wc << 6) | ((unsigned char)s[i + j] & 0x3F);
+		if (n == 0 || j < n) {
+			n = 1;
+			k = putkey(key, map, k, s + i, 1, i);
+			continue;
+		}
+
+		if (config.stripaccents && BETWEEN(wc, 0x300, 0x36F))
+			continue;
+		wc = towlower(wc);
+		if (wc == 0xDF) {
+			k = putkey(key, map, k, "ss", 2, i);
+		} else if (config.stripaccents && BETWEEN(wc, 0xC0, 0x17F) && accents[wc - 0xC0] != '.') {
+			k = putkey(key, map, k, &accents[wc - 0xC0], 1, i);
+		} else if (wc < 0x800) {
+			b[0] = 0xC0 | (wc >> 6);
+			b[1] = 0x80 | (wc & 0x3F);
+			k = putkey(key, map, k, b, 2, i);
+		} else if (wc < 0x10000) {
+			b[0] = 0xE0 | (wc >> 12);
+			b[1] = 0x80 | ((wc >> 6) & 0x3F);
+			b[2] = 0x80 | (wc & 0x3F);
+			k = putkey(key, map, k, b, 3, i);
+		} else {
+			b[0] = 0xF0 | (wc >> 18);
+			b[1] = 0x80 | ((wc >> 12) & 0x3F);
+			b[2] = 0x80 | ((wc >> 6) & 0x3F);
+			b[3] = 0x80 | (wc & 0x3F);
+			k = putkey(key, map, k, b, 4, i);
+		}
+	}
+	return k;
+}
+
+/* compute the normalized key of the matched string of item, so -i compares bytes */
+static void
+itemkey(struct Arena *arena, struct Item *item)
+{
+	const char *s;
+	char *key;
+	size_t i, n, len;
+	int upper;
+
+	s = itemstring(item, &len);
+	item->key = NULL;
+	item->keylen = 0;
+	item->keymap = NULL;
+
+	/* an ASCII string is its own key, unless it has capital letters; no map is needed */
+	for (i = 0, upper = 0; i < len && (unsigned char)s[i] < 0x80; i++)
+		upper |= BETWEEN(s[i], 'A', 'Z');
+	if (i == len && !upper) {
+		item->key = (char *)s;
+		item->keylen = len;
+		return;
+	}
+	if (i == len) {
+		key = arenaalloc(arena, MAX(len, 1), 1);
+		normalize(s, len, key, NULL);
+		item->key = key;
+		item->keylen = len;
+		return;
+	}
+
+	/* a key too long for its length to be kept is not used, the string is compared with its case folded */
+	if ((n = normalize(s, len, NULL, NULL)) > UINT32_MAX)
+		return;
+	item->keylen = n;
+	item->key = arenaalloc(arena, MAX(item->keylen, 1), 1);
+	item->keymap = arenaalloc(arena, (item->keylen + 1) * sizeof *item->keymap, sizeof *item->keymap);
+	item->keymap[item->keylen] = len;
+	normalize(s, len, item->key, item->keymap);
+}
+
+/*
+ * Write into words the offsets (other than 0) where the words of s begin, up
+ * to max offsets, and return how many there are.  A word begins after a word
+ * delimiter and, if config.camelcase is set, at a capital letter after a
+ * lowercase letter or a digit or at the last capital letter of an acronym.
+ */
+static size_t
+splitwords(const char *s, size_t len, uint32_t *words, size_t max)
+{
+	unsigned char c, prev;
+	size_t i, n;
+	int delim, prevdelim;
+
+	n = 0;
+	prevdelim = len > 0 && isdelim(s[0]);
+	for (i = 1; i < len; i++, prevdelim = delim) {
+		c = s[i];
+		if ((delim = isdelim(c)))
+			continue;
+		if (!prevdelim) {
+			prev = s[i - 1];
+			if (!config.camelcase || !isupper(c))
+				continue;
+			if (!islower(prev) && !isdigit(prev) &&
+			    !(isupper(prev) && i + 1 < len && islower((unsigned char)s[i + 1])))
+				continue;
+		}
+		if (n < max)
+			words[n] = i;
+		n++;
+	}
+	return n;
+}
+
+/*
+ * Record where the words of the matched string of item begin, so matching
+ * does not look for them; with -i, the item gets its key, and the offsets
+ * are those of the words in the key.
+ */
+static void
+itemwords(struct Arena *arena, struct Item *item)
+{
+	static uint32_t firstword = 0;
+	uint32_t words[64];
+	const char *s;
+	size_t i, k, n, len;
+
+	if (fstrncmp == strncasecmp) {
+		itemkey(arena, item);
+	} else {
+		item->key = NULL;
+		item->keylen = 0;
+		item->keymap = NULL;
+	}
+	s = itemstring(item, &len);
+	item->words = NULL;
+	item->nwords = 0;
+	if ((n = splitwords(s, len, words, LEN(words))) == 0) {
+		/* most items are a single word, they share its offset */
+		item->words = &firstword;
+		item->nwords = 1;
+		return;
+	}
+	item->words = arenaalloc(arena, (n + 1) * sizeof *item->words, sizeof *item->words);
+	item->words[0] = 0;
+	if (n <= LEN(words))
+		memcpy(item->words + 1, words, n * sizeof *words);
+	else
+		splitwords(s, len, item->words + 1, n);
+	item->nwords = n + 1;
+
+	/* the offsets in the key are those of the first bytes coming from the offsets in the string */
+	if (item->keymap != NULL) {
+		for (i = 1, k = 0; i < item->nwords; i++) {
+			while (k < item->keylen && item->keymap[k] < item->words[i])
+				k++;
+			item->words[i] = k;
+		}
+	}
+}
+
+/* allocate a completion item from the arena, its strings are not copied */
 static struct Item *
-allocitem(const char *text, const char *description)
+allocitem(struct Arena *arena, char *text, size_t textlen, char *description, size_t desclen)
 {
 	struct Item *item;
 
-	item = emalloc(sizeof *item);
-	item->text = estrdup(text);
-	item->description = description ? estrdup(description) : NULL;
+	item = arenaalloc(arena, sizeof *item, sizeof (void *));
+	item->text = text;
+	item->textlen = textlen;
+	item->description = description;
+	item->desclen = desclen;
 	item->prevmatch = item->nextmatch = NULL;
 	item->prev = item->next = NULL;
 	item->parent = NULL;
 	item->child = NULL;
+	itemwords(arena, item);
 
 	return item;
 }
 
-/* build the item tree */
-static struct Item *
-builditems(unsigned level, const char *text, const char *description)
+/* place item of the given indentation level in the tree, after previtem of level prevlevel */
+static void
+placeitem(struct Item *curritem, unsigned level, struct Item *previtem, unsigned prevlevel)
 {
-	static struct Item *rootitem = NULL;
-	static struct Item *previtem = NULL;
-	static unsigned prevlevel = 0;
-	struct Item *curritem;
 	struct Item *item;
 	unsigned i;
 
-	curritem = allocitem(text, description);
-
-	if (previtem == NULL) {             /* there is no item yet */
-		curritem->parent = NULL;
-		rootitem = curritem;
-	} else if (level < prevlevel) {     /* item is continuation of a parent item */
+	if (level < prevlevel) {            /* item is continuation of a parent item */
 		/* go up the item tree until find the item the current one continues */
 		for (item = previtem, i = level;
 		     item != NULL && i != prevlevel;
@@ -459,137 +933,1232 @@ builditems(unsigned level, const char *text, const char *description)
 		previtem->child = curritem;
 		curritem->parent = previtem;
 	}
-
-	prevlevel = level;
-	previtem = curritem;
-
-	return rootitem;
 }
 
-/* create completion items from the stdin */
+/* build the item tree */
 static struct Item *
-parsestdin(FILE *fp)
+builditems(unsigned level, char *text, size_t textlen, char *description, size_t desclen)
 {
-	struct Item *rootitem;
-	char *s, buf[INPUTSIZ];
-	char *text, *description;
-	unsigned level = 0;
+	struct Item *curritem;
 
-	rootitem = NULL;
+	curritem = allocitem(&itemarena, text, textlen, description, desclen);
 
-	while (fgets(buf, sizeof buf, fp) != NULL) {
-		/* discard empty lines */
-		if (*buf && *buf == '\n')
-			continue;
+	if (readprev == NULL) {             /* there is no item yet */
+		curritem->parent = NULL;
+		readroot = curritem;
+	} else {
+		placeitem(curritem, level, readprev, readlevel);
+	}
 
-		/* get the indentation level */
-		level = strspn(buf, "\t");
+	readlevel = level;
+	readprev = curritem;
 
-		/* get the item text */
-		s = buf + level;
-		text = strtok(s, "\t\n");
-		description = strtok(NULL, "\t\n");
+	return readroot;
+}
 
-		/* discard empty text entries */
-		if (!text || *text == '\0')
-			continue;
+/* get the indentation level and the strings of the item in line; return zero if line is to be discarded */
+static int
+splitline(char *line, size_t len, struct Item *item, unsigned *level)
+{
+	char *end;
+
+	end = line + len;
+
+	/* get the indentation level */
+	for (*level = 0; line < end && *line == '\t'; line++)
+		(*level)++;
+
+	/* discard empty lines and empty text entries, and lines too long for the lengths of their strings */
+	if (line == end || len > UINT32_MAX)
+		return 0;
+
+	/* get the item text */
+	item->text = line;
+	if ((line = memchr(line, '\t', end - line)) == NULL)
+		line = end;
+	item->textlen = line - item->text;
+
+	/* get the item description */
+	while (line < end && *line == '\t')
+		line++;
+	item->description = line;
+	if ((line = memchr(line, '\t', end - line)) == NULL)
+		line = end;
+	item->desclen = line - item->description;
+	if (item->desclen == 0)
+		item->description = NULL;
+
+	return 1;
+}
 
-		rootitem = builditems(level, text, description);
-	}
+/* copy the len bytes of s into the item arena, unless an equal string was already copied */
+static char *
+internstr(char *s, size_t len)
+{
+	struct String *str;
 
-	return rootitem;
+	str = intern(&readstrings, s, len);
+	if (str->s == NULL)
+		str->s = arenastrndup(&itemarena, s, len);
+	return str->s;
 }
 
-/* parse the history file */
-static void
-loadhist(FILE *fp, struct History *hist)
+/* create completion item from line, copying its strings if copy is nonzero;
+ * return the root item or NULL if line is discarded */
+static struct Item *
+parseline(char *line, size_t len, int copy)
 {
-	char buf[INPUTSIZ];
-	char *s;
-	size_t len;
+	struct Item item;
+	unsigned level;
 
-	hist->entries = ecalloc(config.histsize, sizeof *hist);
-	hist->size = 0;
-	rewind(fp);
-	while (hist->size < config.histsize && fgets(buf, sizeof buf, fp) != NULL) {
-		len = strlen(buf);
-		if (len && buf[--len] == '\n')
-			buf[len] = '\0';
-		s = estrdup(buf);
-		hist->entries[hist->size++] = s;
+	if (!splitline(line, len, &item, &level))
+		return NULL;
+	if (copy) {
+		item.text = internstr(item.text, item.textlen);
+		if (item.description != NULL)
+			item.description = internstr(item.description, item.desclen);
 	}
-
-	if (hist->size)
-		hist->index = hist->size;
-
-	hflag = (ferror(fp)) ? 0 : 1;
+	return builditems(level, item.text, item.textlen, item.description, item.desclen);
 }
 
-/* get next utf8 char from s return its codepoint and set next_ret to pointer to end of character */
-static FcChar32
-getnextutf8char(const char *s, const char **next_ret)
+/*
+ * Create completion items from a chunk of lines, in a thread.
+ * Items are linked to the items of the same chunk, the same way builditems()
+ * does.  Items whose parent is in a previous chunk (which has not been linked
+ * yet) are stitched to the tree later, by stitchitems().
+ */
+static void *
+parsechunk(void *arg)
 {
-	static const unsigned char utfbyte[] = {0x80, 0x00, 0xC0, 0xE0, 0xF0};
-	static const unsigned char utfmask[] = {0xC0, 0x80, 0xE0, 0xF0, 0xF8};
-	static const FcChar32 utfmin[] = {0, 0x00,  0x80,  0x800,  0x10000};
-	static const FcChar32 utfmax[] = {0, 0x7F, 0x7FF, 0xFFFF, 0x10FFFF};
-	/* 0xFFFD is the replacement character, used to represent unknown characters */
-	static const FcChar32 unknown = 0xFFFD;
-	FcChar32 ucode;         /* FcChar32 type holds 32 bits */
-	size_t usize = 0;       /* n' of bytes of the utf8 character */
-	size_t i;
+	struct Parse *parse;
+	struct Stitch *stitch;
+	struct Item *item, *previtem, *anchor;
+	unsigned level, prevlevel, depth, steps;
+	char *beg, *end;
+
+	parse = (struct Parse *)arg;
+	item = previtem = NULL;
+	prevlevel = depth = 0;      /* depth of previtem below the first items of the chunk */
+	for (beg = parse->beg; beg < parse->end; beg = end + 1) {
+		if ((end = memchr(beg, '\n', parse->end - beg)) == NULL)
+			end = parse->end;
+		if (item == NULL)
+			item = arenaalloc(&parse->arena, sizeof *item, sizeof (void *));
+		if (!splitline(beg, end - beg, item, &level))
+			continue;
+		itemwords(&parse->words, item);
+		item->prevmatch = item->nextmatch = NULL;
+		item->prev = item->next = NULL;
+		item->parent = NULL;
+		item->child = NULL;
+		if (previtem == NULL) {                 /* first item of the chunk */
+			parse->first = item;
+			parse->firstlevel = level;
+		} else if (level > prevlevel) {         /* item begins a new list */
+			previtem->child = item;
+			item->parent = previtem;
+			depth++;
+		} else {                                /* item continues previtem or a parent of it */
+			/* go up the item tree, but not beyond the chunk */
+			for (anchor = previtem, steps = prevlevel - level;
+			     steps > 0 && depth > 0;
+			     anchor = anchor->parent, steps--, depth--)
+				;
+			if (steps == 0) {
+				anchor->next = item;
+				item->prev = anchor;
+				item->parent = anchor->parent;
+			}
+			if (depth == 0) {
+				/* the parent of item is not known yet */
+				if (parse->nstitches == parse->maxstitches) {
+					parse->maxstitches = parse->maxstitches ? parse->maxstitches * 2 : 64;
+					parse->stitches = realloc(parse->stitches, parse->maxstitches * sizeof *parse->stitches);
+					if (parse->stitches == NULL)
+						err(1, "realloc");
+				}
+				stitch = &parse->stitches[parse->nstitches++];
+				stitch->item = item;
+				stitch->anchor = anchor;
+				stitch->steps = steps;
+			}
+		}
+		prevlevel = level;
+		previtem = item;
+		item = NULL;
+	}
+	parse->last = previtem;
+	parse->lastlevel = prevlevel;
 
-	*next_ret = s+1;
+	return NULL;
+}
 
-	/* get code of first byte of utf8 character */
-	for (i = 0; i < sizeof utfmask; i++) {
-		if (((unsigned char)*s & utfmask[i]) == utfbyte[i]) {
-			usize = i;
-			ucode = (unsigned char)*s & ~utfmask[i];
-			break;
+/* link the items parsed in chunks to each other, in order; return the root item */
+static struct Item *
+stitchitems(struct Parse *parses, size_t nparses)
+{
+	struct Item *rootitem, *previtem, *item;
+	struct Stitch *stitch;
+	unsigned prevlevel, i;
+	size_t n, j;
+
+	rootitem = previtem = NULL;
+	prevlevel = 0;
+	for (n = 0; n < nparses; n++) {
+		if (parses[n].first == NULL)
+			continue;
+		if (previtem == NULL)
+			rootitem = parses[n].first;
+		else
+			placeitem(parses[n].first, parses[n].firstlevel, previtem, prevlevel);
+		for (j = 0; j < parses[n].nstitches; j++) {
+			stitch = &parses[n].stitches[j];
+			for (item = stitch->anchor, i = 0;
+			     item != NULL && i != stitch->steps;
+			     item = item->parent, i++)
+				;
+			if (item == NULL)
+				errx(1, "improper indentation detected");
+			stitch->item->parent = item->parent;
+			item->next = stitch->item;
+			stitch->item->prev = item;
 		}
+		previtem = parses[n].last;
+		prevlevel = parses[n].lastlevel;
 	}
 
-	/* if first byte is a continuation byte or is not allowed, return unknown */
-	if (i == sizeof utfmask || usize == 0)
-		return unknown;
+	return rootitem;
+}
 
-	/* check the other usize-1 bytes */
-	s++;
-	for (i = 1; i < usize; i++) {
-		*next_ret = s+1;
-		/* if byte is nul or is not a continuation byte, return unknown */
-		if (*s == '\0' || ((unsigned char)*s & utfmask[0]) != utfbyte[0])
-			return unknown;
-		/* 6 is the number of relevant bits in the continuation byte */
-		ucode = (ucode << 6) | ((unsigned char)*s & ~utfmask[0]);
-		s++;
+/* list the items of the tree breadth-first, so each list of siblings is contiguous; return the number of items */
+static size_t
+listitems(struct Item *rootitem, struct Item ***items_ret)
+{
+	struct Item **items, *item;
+	size_t i, n, nitems;
+
+	/* count items, walking the tree without recursion */
+	nitems = 0;
+	for (item = rootitem; item != NULL; ) {
+		nitems++;
+		if (item->child != NULL) {
+			item = item->child;
+			continue;
+		}
+		while (item != NULL && item->next == NULL)
+			item = item->parent;
+		if (item != NULL)
+			item = item->next;
 	}
 
-	/* check if ucode is invalid or in utf-16 surrogate halves */
-	if (!BETWEEN(ucode, utfmin[usize], utfmax[usize]) || BETWEEN (ucode, 0xD800, 0xDFFF))
-		return unknown;
-
-	return ucode;
+	items = ecalloc(nitems + 1, sizeof *items);
+	for (n = 0, item = rootitem; item != NULL; item = item->next)
+		items[n++] = item;
+	for (i = 0; i < nitems; i++)
+		for (item = items[i]->child; item != NULL; item = item->next)
+			items[n++] = item;
+	*items_ret = items;
+	return nitems;
 }
 
-/* get which font contains a given code point */
-static XftFont *
-getfontucode(FcChar32 ucode)
+/*
+ * Copy the item tree into an array from the item arena, in which each
+ * list of siblings is contiguous, so scanning a list walks memory in order
+ * rather than chasing items scattered across the tree.  Return the new root.
+ */
+static struct Item *
+packitems(struct Item *rootitem)
 {
-	FcCharSet *fccharset = NULL;
-	FcPattern *fcpattern = NULL;
-	FcPattern *match = NULL;
-	FcResult result;
-	XftFont *retfont = NULL;
-	size_t i;
+	struct Item **items, *packed;
+	size_t i, nitems;
 
-	/* search through the fonts supplied by the user for the first one supporting ucode */
-	for (i = 0; i < dc.nfonts; i++)
-		if (XftCharExists(dpy, dc.fonts[i], ucode) == FcTrue)
-			return dc.fonts[i];
+	if (rootitem == NULL)
+		return NULL;
+	nitems = listitems(rootitem, &items);
+	packed = arenaalloc(&itemarena, nitems * sizeof *packed, sizeof (void *));
 
-	/* if could not find a font in dc.fonts, search through system fonts */
+	/* the .nextmatch of each old item points to its copy, until the copies are linked */
+	for (i = 0; i < nitems; i++) {
+		packed[i] = *items[i];
+		items[i]->nextmatch = &packed[i];
+	}
+	for (i = 0; i < nitems; i++) {
+		packed[i].next = packed[i].next ? packed[i].next->nextmatch : NULL;
+		packed[i].prev = packed[i].prev ? packed[i].prev->nextmatch : NULL;
+		packed[i].child = packed[i].child ? packed[i].child->nextmatch : NULL;
+		packed[i].parent = packed[i].parent ? packed[i].parent->nextmatch : NULL;
+		packed[i].prevmatch = packed[i].nextmatch = NULL;
+	}
+	free(items);
+
+	return packed;
+}
+
+/* create completion items from a compiled image, whose strings are not copied; return -1 on error */
+static int
+loadimage(char *image, size_t size, struct Item **rootitem)
+{
+	struct ImageHeader *header;
+	struct ImageItem *imgitems;
+	struct Item *items, *parent;
+	char *strings;
+	size_t i, j, beg, end, next;
+
+	*rootitem = NULL;
+	header = (struct ImageHeader *)image;
+	if (size < sizeof *header || memcmp(header->magic, IMAGEMAGIC, sizeof IMAGEMAGIC) != 0 ||
+	    header->version != IMAGEVERSION || header->byteorder != IMAGEORDER)
+		return -1;
+	if (header->nitems == 0)
+		return 0;
+	if (header->nroots == 0 || header->nroots > header->nitems ||
+	    (size - sizeof *header) / sizeof *imgitems < header->nitems ||
+	    size - sizeof *header - header->nitems * sizeof *imgitems != header->strsize)
+		goto error;
+	imgitems = (struct ImageItem *)(image + sizeof *header);
+	strings = (char *)(imgitems + header->nitems);
+
+	/*
+	 * each list of siblings is stored contiguously, and lists are
+	 * stored in the order their parents are, so items can be linked
+	 * in a single pass and a corrupted image is easy to detect
+	 */
+	items = arenaalloc(&itemarena, header->nitems * sizeof *items, sizeof (void *));
+	next = header->nroots;
+	for (i = 0; i < header->nitems; i++) {
+		if (imgitems[i].textlen == 0 || imgitems[i].textlen > header->strsize ||
+		    imgitems[i].text > header->strsize - imgitems[i].textlen ||
+		    imgitems[i].desclen > header->strsize ||
+		    imgitems[i].description > header->strsize - imgitems[i].desclen)
+			goto error;
+		items[i].text = strings + imgitems[i].text;
+		items[i].textlen = imgitems[i].textlen;
+		items[i].description = imgitems[i].desclen ? strings + imgitems[i].description : NULL;
+		items[i].desclen = imgitems[i].desclen;
+		items[i].prevmatch = items[i].nextmatch = NULL;
+		items[i].child = NULL;
+		itemwords(&itemarena, &items[i]);
+	}
+	for (i = 0, beg = 0, end = header->nroots, parent = NULL; ; parent = &items[i++]) {
+		for (j = beg; j < end; j++) {
+			items[j].parent = parent;
+			items[j].prev = (j > beg) ? &items[j - 1] : NULL;
+			items[j].next = (j + 1 < end) ? &items[j + 1] : NULL;
+		}
+		if (parent != NULL)
+			parent->child = (end > beg) ? &items[beg] : NULL;
+		if (i == header->nitems)
+			break;
+		if (imgitems[i].nchildren == 0) {
+			beg = end = 0;
+			continue;
+		}
+		if (imgitems[i].child != next || imgitems[i].nchildren > header->nitems - next)
+			goto error;
+		beg = next;
+		end = next += imgitems[i].nchildren;
+	}
+	if (next != header->nitems)
+		goto error;
+
+	*rootitem = items;
+	return 0;
+
+error:
+	return -1;
+}
+
+/* write the item tree into fp as a compiled image; return -1 on error */
+static int
+writeimage(FILE *fp, struct Item *rootitem)
+{
+	struct ImageHeader header;
+	struct ImageItem *imgitems;
+	struct Intern strings = {.strings = NULL, .size = 0, .nstrings = 0};
+	struct String *str;
+	struct Item **items, *item;
+	size_t i, n, nitems;
+	uint64_t strsize, off;
+
+	nitems = listitems(rootitem, &items);
+	if (nitems > UINT32_MAX) {
+		free(items);
+		errno = EOVERFLOW;
+		return -1;
+	}
+
+	/* equal strings (such as the options repeated under each command) are stored once */
+	imgitems = ecalloc(nitems + 1, sizeof *imgitems);
+	for (n = 0, item = rootitem; item != NULL; item = item->next)
+		n++;
+	header.nroots = n;
+	strsize = 0;
+	for (i = 0; i < nitems; i++) {
+		imgitems[i].child = n;
+		for (item = items[i]->child; item != NULL; item = item->next)
+			n++;
+		imgitems[i].nchildren = n - imgitems[i].child;
+		if (imgitems[i].nchildren == 0)
+			imgitems[i].child = 0;
+		imgitems[i].textlen = items[i]->textlen;
+		str = intern(&strings, items[i]->text, items[i]->textlen);
+		if (str->s == NULL) {
+			str->s = items[i]->text;
+			str->off = strsize;
+			strsize += str->len;
+		}
+		imgitems[i].text = str->off;
+		imgitems[i].desclen = items[i]->description ? items[i]->desclen : 0;
+		imgitems[i].description = 0;
+		if (imgitems[i].desclen > 0) {
+			str = intern(&strings, items[i]->description, items[i]->desclen);
+			if (str->s == NULL) {
+				str->s = items[i]->description;
+				str->off = strsize;
+				strsize += str->len;
+			}
+			imgitems[i].description = str->off;
+		}
+		if (strsize > UINT32_MAX) {
+			free(items);
+			free(imgitems);
+			cleanintern(&strings);
+			errno = EOVERFLOW;
+			return -1;
+		}
+	}
+	cleanintern(&strings);
+
+	/* write header, then items, then their strings; a string is new if it is right after the previous ones */
+	memcpy(header.magic, IMAGEMAGIC, sizeof IMAGEMAGIC);
+	header.version = IMAGEVERSION;
+	header.byteorder = IMAGEORDER;
+	header.nitems = nitems;
+	header.strsize = strsize;
+	fwrite(&header, sizeof header, 1, fp);
+	fwrite(imgitems, sizeof *imgitems, nitems, fp);
+	for (off = 0, i = 0; i < nitems; i++) {
+		if (imgitems[i].text == off) {
+			fwrite(items[i]->text, 1, imgitems[i].textlen, fp);
+			off += imgitems[i].textlen;
+		}
+		if (imgitems[i].desclen > 0 && imgitems[i].description == off) {
+			fwrite(items[i]->description, 1, imgitems[i].desclen, fp);
+			off += imgitems[i].desclen;
+		}
+	}
+	free(items);
+	free(imgitems);
+	if (fflush(fp) == EOF || ferror(fp))
+		return -1;
+	return 0;
+}
+
+/* create completion items from the lines in buf, without copying their strings */
+static struct Item *
+parsebuf(char *buf, size_t size)
+{
+	struct Item *rootitem;
+	struct Parse *parses;
+	char *beg, *end;
+	size_t nparses, n;
+	long ncpus;
+
+	/* split the buffer into chunks of whole lines, one for each thread */
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	nparses = (ncpus > 1) ? MIN((size_t)ncpus, MAXTHREADS) : 1;
+	nparses = MIN(nparses, size / PARSESIZ + 1);
+	parses = ecalloc(nparses, sizeof *parses);
+	for (beg = buf, n = 0; n < nparses; n++, beg = end) {
+		end = (n + 1 == nparses) ? buf + size
+		    : MAX(beg, buf + size / nparses * (n + 1));
+		if (end < buf + size && (end = memchr(end, '\n', buf + size - end)) != NULL)
+			end++;
+		else
+			end = buf + size;
+		parses[n].beg = beg;
+		parses[n].end = end;
+	}
+
+	/* parse the chunks in parallel, or in this thread if a thread cannot be created */
+	for (n = 1; n < nparses; n++)
+		parses[n].threaded = pthread_create(&parses[n].thread, NULL, parsechunk, &parses[n]) == 0;
+	parsechunk(&parses[0]);
+	for (n = 1; n < nparses; n++) {
+		if (parses[n].threaded)
+			pthread_join(parses[n].thread, NULL);
+		else
+			parsechunk(&parses[n]);
+	}
+
+	/* the items are copied out of the arenas of the threads, with siblings together */
+	rootitem = packitems(stitchitems(parses, nparses));
+	for (n = 0; n < nparses; n++) {
+		mergearena(&itemarena, &parses[n].words);
+		cleanarena(&parses[n].arena);
+		free(parses[n].stitches);
+	}
+	free(parses);
+
+	return rootitem;
+}
+
+/* create completion items from a file mapped into memory, without copying their strings */
+static struct Item *
+parsefile(const char *file)
+{
+	struct Item *rootitem;
+	struct stat sb;
+	int fd;
+
+	if ((fd = open(file, O_RDONLY)) == -1)
+		err(1, "%s", file);
+	if (fstat(fd, &sb) == -1)
+		err(1, "%s", file);
+	if (sb.st_size == 0) {
+		close(fd);
+		return NULL;
+	}
+	itemmap = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (itemmap == MAP_FAILED)
+		err(1, "%s", file);
+	itemmapsize = sb.st_size;
+	close(fd);
+
+	/* compiled images are loaded rather than parsed */
+	if (itemmapsize >= sizeof (struct ImageHeader) &&
+	    memcmp(itemmap, IMAGEMAGIC, sizeof IMAGEMAGIC) == 0) {
+		if (loadimage(itemmap, itemmapsize, &rootitem) == -1)
+			errx(1, "%s: corrupted or incompatible image", file);
+		return rootitem;
+	}
+
+	return parsebuf(itemmap, itemmapsize);
+}
+
+/* forget the items read while running, and free the incomplete line after them */
+static void
+cleanread(void)
+{
+	free(readbuf);
+	readbuf = NULL;
+	readsize = readlen = 0;
+	readroot = readprev = NULL;
+	readlevel = 0;
+	cleanintern(&readstrings);
+}
+
+/* create completion items from what is available on fd, return zero on end of input */
+static int
+readitems(int fd, struct Item **rootitem)
+{
+	struct Item *item;
+	char *beg, *end, *s;
+	ssize_t n;
+
+	/* make room for a whole block after the incomplete line */
+	if (readsize - readlen < READSIZ) {
+		while (readsize - readlen < READSIZ)
+			readsize = readsize ? readsize * 2 : READSIZ;
+		if ((readbuf = realloc(readbuf, readsize)) == NULL)
+			err(1, "realloc");
+	}
+
+	if ((n = read(fd, readbuf + readlen, readsize - readlen)) == -1) {
+		if (errno == EINTR || errno == EAGAIN)
+			return 1;
+		warn("read");
+	}
+	if (n <= 0) {
+		/* parse the last line, even if it is not terminated by a newline */
+		if (readlen && (item = parseline(readbuf, readlen, 1)) != NULL)
+			*rootitem = item;
+		cleanread();
+		return 0;
+	}
+
+	/* parse each complete line; the incomplete line has no newline to be searched for */
+	beg = readbuf;
+	end = readbuf + readlen + n;
+	for (s = readbuf + readlen; (s = memchr(s, '\n', end - s)) != NULL; beg = ++s)
+		if ((item = parseline(beg, s - beg, 1)) != NULL)
+			*rootitem = item;
+
+	/* keep the incomplete line for the next read */
+	readlen = end - beg;
+	if (beg != readbuf)
+		memmove(readbuf, beg, readlen);
+
+	return 1;
+}
+
+/* get the path of the cached image of len bytes of items hashing to h; return -1 if there is no cache */
+static int
+getcachepath(char *path, size_t size, uint64_t h, size_t len)
+{
+	const char *s;
+	int n;
+
+	if ((s = getenv("XDG_CACHE_HOME")) != NULL && *s != '\0')
+		n = snprintf(path, size, "%s/%s/%016llx-%zx", s, CACHEDIR, (unsigned long long)h, len);
+	else if ((s = getenv("HOME")) != NULL && *s != '\0')
+		n = snprintf(path, size, "%s/.cache/%s/%016llx-%zx", s, CACHEDIR, (unsigned long long)h, len);
+	else
+		return -1;
+	if (n < 0 || (size_t)n >= size)
+		return -1;
+	return 0;
+}
+
+/*
+ * Create completion items from the cached image at path, which is followed
+ * by the len bytes of items in buf it was compiled from; the image is only
+ * used if those are the same, as images are named after a hash that can
+ * collide.  Return -1 if there is no usable image.
+ */
+static int
+loadcache(const char *path, const char *buf, size_t len, struct Item **rootitem)
+{
+	struct ImageHeader *header;
+	struct stat sb;
+	size_t imagesize;
+	char *image;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return -1;
+	if (fstat(fd, &sb) == -1 || (size_t)sb.st_size < sizeof *header + len) {
+		close(fd);
+		return -1;
+	}
+	image = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (image == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+	imagesize = sb.st_size - len;
+	if (memcmp(image + imagesize, buf, len) != 0 ||
+	    loadimage(image, imagesize, rootitem) == -1) {
+		munmap(image, sb.st_size);
+		close(fd);
+		return -1;
+	}
+
+	/* the modification time of an image is when it was last used, for it to be pruned last */
+	futimens(fd, NULL);
+	close(fd);
+	itemmap = image;
+	itemmapsize = sb.st_size;
+	return 0;
+}
+
+/* compare cached images by when they were last used, the least recently used first */
+static int
+cachesort(const void *a, const void *b)
+{
+	const struct CacheEntry *x = a, *y = b;
+
+	if (x->mtime != y->mtime)
+		return (x->mtime < y->mtime) ? -1 : 1;
+	return 0;
+}
+
+/* remove the least recently used images from the cache directory dir, until they fit in CACHEMAX bytes */
+static void
+prunecache(const char *dir)
+{
+	struct CacheEntry *entries;
+	struct dirent *dp;
+	struct stat sb;
+	DIR *dirp;
+	size_t nentries, maxentries, total, i;
+	int dfd;
+
+	if ((dirp = opendir(dir)) == NULL)
+		return;
+	dfd = dirfd(dirp);
+	entries = NULL;
+	nentries = maxentries = total = 0;
+	while ((dp = readdir(dirp)) != NULL) {
+		/* images being written by other instances have a suffix after a dot */
+		if (strchr(dp->d_name, '.') != NULL || strlen(dp->d_name) >= sizeof entries->name)
+			continue;
+		if (fstatat(dfd, dp->d_name, &sb, AT_SYMLINK_NOFOLLOW) == -1 || !S_ISREG(sb.st_mode))
+			continue;
+		if (nentries == maxentries) {
+			maxentries = maxentries ? maxentries * 2 : 64;
+			if ((entries = realloc(entries, maxentries * sizeof *entries)) == NULL)
+				err(1, "realloc");
+		}
+		memcpy(entries[nentries].name, dp->d_name, strlen(dp->d_name) + 1);
+		entries[nentries].mtime = sb.st_mtime;
+		entries[nentries].size = sb.st_size;
+		total += sb.st_size;
+		nentries++;
+	}
+	if (total > CACHEMAX) {
+		qsort(entries, nentries, sizeof *entries, cachesort);
+		for (i = 0; i < nentries && total > CACHEMAX; i++)
+			if (unlinkat(dfd, entries[i].name, 0) == 0)
+				total -= entries[i].size;
+	}
+	free(entries);
+	closedir(dirp);
+}
+
+/*
+ * Write the image of the item tree into the cache, followed by the len
+ * bytes of items in buf it is compiled from; the image is renamed into
+ * place once complete.
+ */
+static void
+savecache(const char *path, const char *buf, size_t len, struct Item *rootitem)
+{
+	char tmp[PATH_MAX];
+	char *s, *t;
+	FILE *fp;
+	int fd;
+
+	/* create the cache directory and its parent, if needed */
+	snprintf(tmp, sizeof tmp, "%s", path);
+	if ((s = strrchr(tmp, '/')) == NULL)
+		return;
+	*s = '\0';
+	if ((t = strrchr(tmp, '/')) != NULL) {
+		*t = '\0';
+		mkdir(tmp, 0700);
+		*t = '/';
+	}
+	if (mkdir(tmp, 0700) == -1 && errno != EEXIST)
+		return;
+	*s = '/';
+
+	/* concurrent instances write into different temporary files */
+	if ((size_t)snprintf(tmp, sizeof tmp, "%s.XXXXXX", path) >= sizeof tmp)
+		return;
+	if ((fd = mkstemp(tmp)) == -1)
+		return;
+	if ((fp = fdopen(fd, "w")) == NULL) {
+		close(fd);
+		unlink(tmp);
+		return;
+	}
+	if (writeimage(fp, rootitem) == -1 || fwrite(buf, 1, len, fp) != len) {
+		fclose(fp);
+		unlink(tmp);
+		return;
+	}
+	if (fclose(fp) == EOF || rename(tmp, path) == -1) {
+		unlink(tmp);
+		return;
+	}
+
+	/* the cache directory is kept from growing without bound */
+	*strrchr(tmp, '/') = '\0';
+	prunecache(tmp);
+}
+
+/* free the items kept by the daemon */
+static void
+cleankeep(void)
+{
+	cleanarena(&keep.arena);
+	free(keep.buf);
+	free(keep.worddelimiters);
+	if (keep.map != NULL)
+		munmap(keep.map, keep.mapsize);
+	keep.rootitem = NULL;
+	keep.input = NULL;
+	keep.worddelimiters = NULL;
+	keep.buf = NULL;
+	keep.map = NULL;
+}
+
+/* keep the items read from stdin, and the memory they are in, for the next clients of the daemon */
+static void
+keepitems(struct Item *rootitem, char *input, uint64_t hash, size_t len)
+{
+	keep.rootitem = rootitem;
+	keep.input = input;
+	keep.arena = itemarena;
+	keep.buf = itembuf;
+	keep.map = itemmap;
+	keep.mapsize = itemmapsize;
+	keep.hash = hash;
+	keep.len = len;
+	keep.dflag = dflag;
+	keep.fold = (fstrncmp == strncasecmp);
+	keep.stripaccents = config.stripaccents;
+	keep.worddelimiters = estrdup(config.worddelimiters);
+	itemarena.chunk = NULL;
+	itembuf = NULL;
+	itemmap = NULL;
+}
+
+/* create completion items from the stdin, whose images are cached if usecache is nonzero */
+static struct Item *
+parsestdin(int usecache)
+{
+	struct Item *rootitem;
+	char path[PATH_MAX];
+	char *input;
+	size_t size, len, hashed;
+	ssize_t n;
+	uint64_t h;
+
+	/* read the whole stdin, hashing each block while it is still in the cpu cache */
+	size = len = hashed = 0;
+	h = HASHSEED;
+	for (;;) {
+		if (size - len < READSIZ) {
+			while (size - len < READSIZ)
+				size = size ? size * 2 : READSIZ;
+			if ((itembuf = realloc(itembuf, size)) == NULL)
+				err(1, "realloc");
+		}
+		if ((n = read(STDIN_FILENO, itembuf + len, size - len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			warn("read");
+		}
+		if (n <= 0)
+			break;
+		len += n;
+		if (usecache) {
+			n = (len - hashed) & ~(size_t)7;
+			h = hashbytes(h, itembuf + hashed, n);
+			hashed += n;
+		}
+	}
+
+	if (!usecache)
+		return parsebuf(itembuf, len);
+	h = hashbytes(h, itembuf + hashed, len - hashed);
+
+	/* the daemon reuses the items of the previous client, if they are the same and split and normalized the same way */
+	if (Dflag) {
+		if (keep.rootitem != NULL && keep.hash == h && keep.len == len && keep.dflag == dflag &&
+		    keep.fold == (fstrncmp == strncasecmp) && keep.stripaccents == config.stripaccents &&
+		    strcmp(keep.worddelimiters, config.worddelimiters) == 0 &&
+		    memcmp(keep.input, itembuf, len) == 0) {
+			free(itembuf);
+			itembuf = NULL;
+			return keep.rootitem;
+		}
+		cleankeep();
+	}
+
+	/* small inputs are parsed faster than their images are looked up */
+	if (len < CACHESIZ || getcachepath(path, sizeof path, h, len) == -1) {
+		rootitem = parsebuf(itembuf, len);
+		input = itembuf;
+	} else if (loadcache(path, itembuf, len, &rootitem) == 0) {
+		free(itembuf);
+		itembuf = NULL;
+		input = itemmap + itemmapsize - len;
+	} else {
+		rootitem = parsebuf(itembuf, len);
+		savecache(path, itembuf, len, rootitem);
+		input = itembuf;
+	}
+
+	if (Dflag)
+		keepitems(rootitem, input, h, len);
+	return rootitem;
+}
+
+/* parse the history file */
+static void
+loadhist(FILE *fp, struct History *hist)
+{
+	char buf[INPUTSIZ];
+	char *s;
+	size_t len;
+
+	hist->entries = ecalloc(config.histsize, sizeof *hist);
+	hist->size = 0;
+	rewind(fp);
+	while (hist->size < config.histsize && fgets(buf, sizeof buf, fp) != NULL) {
+		len = strlen(buf);
+		if (len && buf[--len] == '\n')
+			buf[len] = '\0';
+		s = estrdup(buf);
+		hist->entries[hist->size++] = s;
+	}
+
+	if (hist->size)
+		hist->index = hist->size;
+
+	hflag = (ferror(fp)) ? 0 : 1;
+}
+
+/* write len bytes of buf at offset off of fd; return -1 on error */
+static int
+pwriteall(int fd, const void *buf, size_t len, off_t off)
+{
+	ssize_t n;
+
+	for (; len > 0; buf = (const char *)buf + n, len -= n, off += n)
+		if ((n = pwrite(fd, buf, len, off)) <= 0)
+			return -1;
+	return 0;
+}
+
+/* write into fd a usage file with nbuckets buckets and the records, relinked into them; return -1 on error */
+static int
+writeusage(int fd, uint32_t nbuckets, struct UsageRecord *records, size_t nrecords)
+{
+	struct UsageHeader header;
+	uint32_t *buckets;
+	size_t i, b;
+	int ret;
+
+	memset(&header, 0, sizeof header);
+	memcpy(header.magic, USAGEMAGIC, sizeof USAGEMAGIC);
+	header.version = USAGEVERSION;
+	header.byteorder = IMAGEORDER;
+	header.nbuckets = nbuckets;
+
+	/* records are linked in the order they were appended, the last one first */
+	buckets = ecalloc(nbuckets, sizeof *buckets);
+	for (i = 0; i < nrecords; i++) {
+		b = records[i].hash & (nbuckets - 1);
+		records[i].next = buckets[b];
+		buckets[b] = i + 1;
+	}
+	ret = 0;
+	if (pwriteall(fd, &header, sizeof header, 0) == -1 ||
+	    pwriteall(fd, buckets, nbuckets * sizeof *buckets, sizeof header) == -1 ||
+	    pwriteall(fd, records, nrecords * sizeof *records, sizeof header + nbuckets * sizeof *buckets) == -1)
+		ret = -1;
+	free(buckets);
+	return ret;
+}
+
+/* map the usage file into memory again, if it has grown or has other buckets; return -1 if it is not a usage file */
+static int
+mapusage(void)
+{
+	struct UsageHeader *header;
+	struct stat sb;
+	size_t size, off;
+	char *map;
+
+	if (fstat(usefile.fd, &sb) == -1)
+		return -1;
+	size = sb.st_size;
+	if (usefile.map != NULL && size == usefile.mapsize &&
+	    ((struct UsageHeader *)usefile.map)->nbuckets == usefile.nbuckets)
+		return 0;
+	if (size < sizeof *header)
+		return -1;
+	if ((map = mmap(NULL, size, PROT_READ, MAP_SHARED, usefile.fd, 0)) == MAP_FAILED)
+		return -1;
+	header = (struct UsageHeader *)map;
+	off = sizeof *header + (size_t)header->nbuckets * sizeof *usefile.buckets;
+	if (memcmp(header->magic, USAGEMAGIC, sizeof USAGEMAGIC) != 0 ||
+	    header->version != USAGEVERSION || header->byteorder != IMAGEORDER ||
+	    header->nbuckets == 0 || (header->nbuckets & (header->nbuckets - 1)) != 0 || size < off) {
+		munmap(map, size);
+		return -1;
+	}
+	if (usefile.map != NULL)
+		munmap(usefile.map, usefile.mapsize);
+	usefile.map = map;
+	usefile.mapsize = size;
+	usefile.nbuckets = header->nbuckets;
+	usefile.buckets = (uint32_t *)(map + sizeof *header);
+	usefile.records = (struct UsageRecord *)(map + off);
+
+	/* a record being appended by another instance is not complete yet */
+	usefile.nrecords = MIN((size - off) / sizeof *usefile.records, UINT32_MAX - 1);
+	return 0;
+}
+
+/* unmap and close the usage file */
+static void
+closeusage(void)
+{
+	if (usefile.map != NULL)
+		munmap(usefile.map, usefile.mapsize);
+	if (usefile.fd != -1)
+		close(usefile.fd);
+	usefile.map = NULL;
+	usefile.mapsize = 0;
+	usefile.nrecords = 0;
+	usefile.fd = -1;
+}
+
+/*
+ * Lock the usage file with op.  When the buckets are doubled, the file is
+ * replaced by a new one; if it was replaced while the lock was waited for,
+ * the new file is opened and locked instead, so the old one, which other
+ * instances may still have mapped, is never written to again.  Return -1
+ * on error, with the file unlocked.
+ */
+static int
+lockusage(int op)
+{
+	struct stat sb, st;
+	int fd;
+
+	for (;;) {
+		if (flock(usefile.fd, op) == -1)
+			return -1;
+		if (stat(usefile.path, &sb) == -1 || fstat(usefile.fd, &st) == -1 ||
+		    (sb.st_dev == st.st_dev && sb.st_ino == st.st_ino))
+			return 0;
+		if ((fd = open(usefile.path, O_RDWR)) == -1) {
+			flock(usefile.fd, LOCK_UN);
+			return -1;
+		}
+		closeusage();
+		usefile.fd = fd;
+	}
+}
+
+/* open the usage file at path, creating it if it does not exist */
+static void
+openusage(const char *path)
+{
+	struct stat sb;
+
+	if ((usefile.fd = open(path, O_RDWR | O_CREAT, 0600)) == -1) {
+		warn("%s", path);
+		return;
+	}
+	usefile.path = path;
+	usefile.now = time(NULL);
+	if (lockusage(LOCK_EX) == -1) {
+		closeusage();
+		return;
+	}
+	if (fstat(usefile.fd, &sb) == 0 && sb.st_size == 0)
+		writeusage(usefile.fd, USAGEBUCKETS, NULL, 0);
+	if (mapusage() == -1) {
+		warnx("%s: not a usage file", path);
+		closeusage();
+		return;
+	}
+	flock(usefile.fd, LOCK_UN);
+}
+
+/* map the usage file again, if another instance wrote to it or replaced it, before the items are ranked */
+static void
+refreshusage(void)
+{
+	if (usefile.fd == -1 || lockusage(LOCK_SH) == -1)
+		return;
+	if (mapusage() == -1)
+		closeusage();
+	else
+		flock(usefile.fd, LOCK_UN);
+}
+
+/* hash the path of item in the tree, given the hash h of the path of its parent */
+static uint64_t
+itemhash(uint64_t h, struct Item *item)
+{
+	h = hashbytes(h, item->text, item->textlen);
+	return (h ^ item->textlen) * HASHMUL;
+}
+
+/* hash the path of item in the tree, from the item at the top down to it */
+static uint64_t
+pathhash(struct Item *item)
+{
+	return itemhash(item->parent != NULL ? pathhash(item->parent) : HASHSEED, item);
+}
+
+/* return the index of the last record of the path hashing to h, or -1 if there is none */
+static ssize_t
+findusage(uint64_t h)
+{
+	size_t i, n;
+
+	i = usefile.buckets[h & (usefile.nbuckets - 1)];
+	for (n = 0; i > 0 && i <= usefile.nrecords && n < usefile.nrecords; n++) {
+		if (usefile.records[i - 1].hash == h)
+			return i - 1;
+		i = usefile.records[i - 1].next;
+	}
+	return -1;
+}
+
+/* score how frecently the item of record was chosen */
+static unsigned
+frecency(struct UsageRecord *record)
+{
+	static const struct {
+		time_t age;
+		unsigned weight;
+	} weights[] = {
+		{ 4 * DAYSECS,  100 },
+		{ 14 * DAYSECS, 70 },
+		{ 31 * DAYSECS, 50 },
+		{ 90 * DAYSECS, 30 },
+	};
+	unsigned weight;
+	size_t j;
+
+	weight = 10;
+	for (j = 0; j < LEN(weights); j++) {
+		if (usefile.now - record->time < weights[j].age) {
+			weight = weights[j].weight;
+			break;
+		}
+	}
+	return MIN(record->count, UINT_MAX / weight) * weight;
+}
+
+/*
+ * Double the buckets of the usage file.  The records are relinked into a
+ * new file, which replaces the old one at once, so the records are never
+ * moved in a file other instances have mapped, and a crash leaves either
+ * file whole.  Called with the lock held.
+ */
+static void
+growusage(void)
+{
+	struct UsageRecord *records;
+	char tmp[PATH_MAX];
+	int fd;
+
+	if ((size_t)snprintf(tmp, sizeof tmp, "%s.XXXXXX", usefile.path) >= sizeof tmp)
+		return;
+	if ((fd = mkstemp(tmp)) == -1)
+		return;
+	records = emalloc(usefile.nrecords * sizeof *records);
+	memcpy(records, usefile.records, usefile.nrecords * sizeof *records);
+	if (writeusage(fd, usefile.nbuckets * 2, records, usefile.nrecords) == -1 ||
+	    fsync(fd) == -1 || rename(tmp, usefile.path) == -1) {
+		free(records);
+		close(fd);
+		unlink(tmp);
+		return;
+	}
+	free(records);
+	closeusage();
+	usefile.fd = fd;
+	if (mapusage() == -1)
+		closeusage();
+}
+
+/* record in the usage file that item was chosen */
+static void
+useitem(struct Item *item)
+{
+	struct UsageRecord record;
+	uint64_t h, parent;
+	uint32_t head;
+	ssize_t i;
+	size_t b;
+	off_t off;
+
+	if (usefile.fd == -1)
+		return;
+	parent = (item->parent != NULL) ? pathhash(item->parent) : HASHSEED;
+	h = itemhash(parent, item);
+	if (lockusage(LOCK_EX) == -1)
+		return;
+	if (mapusage() == -1)
+		goto done;
+	off = (char *)usefile.records - usefile.map;
+	if ((i = findusage(h)) != -1) {
+		/* update the record in place */
+		record = usefile.records[i];
+		if (record.count < UINT32_MAX)
+			record.count++;
+		record.time = time(NULL);
+		pwriteall(usefile.fd, &record, sizeof record, off + i * sizeof record);
+	} else {
+		/* append a new record, and only then link it into its bucket */
+		b = h & (usefile.nbuckets - 1);
+		record.hash = h;
+		record.parent = parent;
+		record.next = usefile.buckets[b];
+		record.count = 1;
+		record.time = time(NULL);
+		if (pwriteall(usefile.fd, &record, sizeof record, off + usefile.nrecords * sizeof record) == -1)
+			goto done;
+		head = usefile.nrecords + 1;
+		if (pwriteall(usefile.fd, &head, sizeof head, sizeof (struct UsageHeader) + b * sizeof head) == -1)
+			goto done;
+		if (mapusage() != -1 && usefile.nrecords > (size_t)usefile.nbuckets * USAGELOAD)
+			growusage();
+	}
+done:
+	if (usefile.fd != -1)
+		flock(usefile.fd, LOCK_UN);
+}
+
+/* get next utf8 char from s, not reading past end if not NULL, return its codepoint and set next_ret to pointer to end of character */
+static FcChar32
+getnextutf8char(const char *s, const char *end, const char **next_ret)
+{
+	static const unsigned char utfbyte[] = {0x80, 0x00, 0xC0, 0xE0, 0xF0};
+	static const unsigned char utfmask[] = {0xC0, 0x80, 0xE0, 0xF0, 0xF8};
+	static const FcChar32 utfmin[] = {0, 0x00,  0x80,  0x800,  0x10000};
+	static const FcChar32 utfmax[] = {0, 0x7F, 0x7FF, 0xFFFF, 0x10FFFF};
+	/* 0xFFFD is the replacement character, used to represent unknown characters */
+	static const FcChar32 unknown = 0xFFFD;
+	FcChar32 ucode;         /* FcChar32 type holds 32 bits */
+	size_t usize = 0;       /* n' of bytes of the utf8 character */
+	size_t i;
+
+	*next_ret = s+1;
+
+	/* get code of first byte of utf8 character */
+	for (i = 0; i < sizeof utfmask; i++) {
+		if (((unsigned char)*s & utfmask[i]) == utfbyte[i]) {
+			usize = i;
+			ucode = (unsigned char)*s & ~utfmask[i];
+			break;
+		}
+	}
+
+	/* if first byte is a continuation byte or is not allowed, return unknown */
+	if (i == sizeof utfmask || usize == 0)
+		return unknown;
+
+	/* check the other usize-1 bytes */
+	s++;
+	for (i = 1; i < usize; i++) {
+		/* if string ends or byte is not a continuation byte, return unknown */
+		if (end ? s >= end : *s == '\0')
+			return unknown;
+		*next_ret = s+1;
+		if (((unsigned char)*s & utfmask[0]) != utfbyte[0])
+			return unknown;
+		/* 6 is the number of relevant bits in the continuation byte */
+		ucode = (ucode << 6) | ((unsigned char)*s & ~utfmask[0]);
+		s++;
+	}
+
+	/* check if ucode is invalid or in utf-16 surrogate halves */
+	if (!BETWEEN(ucode, utfmin[usize], utfmax[usize]) || BETWEEN (ucode, 0xD800, 0xDFFF))
+		return unknown;
+
+	return ucode;
+}
+
+/* get which font contains a given code point */
+static XftFont *
+getfontucode(FcChar32 ucode)
+{
+	FcCharSet *fccharset = NULL;
+	FcPattern *fcpattern = NULL;
+	FcPattern *match = NULL;
+	FcResult result;
+	XftFont *retfont = NULL;
+	size_t i;
+
+	/* search through the fonts supplied by the user for the first one supporting ucode */
+	for (i = 0; i < dc.nfonts; i++)
+		if (XftCharExists(dpy, dc.fonts[i], ucode) == FcTrue)
+			return dc.fonts[i];
+
+	/* if could not find a font in dc.fonts, search through system fonts */
 
 	/* create a charset containing our code point */
 	fccharset = FcCharSetCreate();
@@ -638,14 +2207,14 @@ drawtext(XftDraw *draw, XftColor *color, int x, int y, unsigned h, const char *t
 
 	nextfont = dc.fonts[0];
 	end = text + textlen;
-	while (*text && (!textlen || text < end)) {
+	while (textlen ? text < end : *text != '\0') {
 		tmp = text;
 		do {
 			next = tmp;
 			currfont = nextfont;
-			ucode = getnextutf8char(next, &tmp);
+			ucode = getnextutf8char(next, textlen ? end : NULL, &tmp);
 			nextfont = getfontucode(ucode);
-		} while (*next && (!textlen || next < end) && currfont == nextfont);
+		} while ((textlen ? next < end : *next != '\0') && currfont == nextfont);
 		len = next - text;
 		XftTextExtentsUtf8(dpy, currfont, (XftChar8 *)text, len, &ext);
 		textwidth += ext.xOff;
@@ -760,6 +2329,26 @@ drawinput(struct Prompt *prompt, int copy)
 		          prompt->w - x, prompt->h, x, 0);
 }
 
+/* draw the len bytes at s, the string of an item that was matched, with the span that matched highlighted; return its width */
+static int
+drawmatch(struct Prompt *prompt, XftColor *color, int x, int y, struct Span *span, const char *s, size_t len)
+{
+	size_t beg, end;
+	int w;
+
+	beg = MIN(span->beg, len);
+	end = MAX(beg, MIN(span->end, len));
+	if (beg == end)
+		return drawtext(prompt->draw, &color[ColorFG], x, y, prompt->h, s, len);
+	w = 0;
+	if (beg > 0)
+		w += drawtext(prompt->draw, &color[ColorFG], x, y, prompt->h, s, beg);
+	w += drawtext(prompt->draw, &color[ColorHL], x + w, y, prompt->h, s + beg, end - beg);
+	if (end < len)
+		w += drawtext(prompt->draw, &color[ColorFG], x + w, y, prompt->h, s + end, len - end);
+	return w;
+}
+
 /* draw nth item in the item array */
 static void
 drawitem(struct Prompt *prompt, size_t n, int copy)
@@ -780,17 +2369,18 @@ drawitem(struct Prompt *prompt, size_t n, int copy)
 
 	if (!(dflag && prompt->itemarray[n]->description)) {
 		/* draw item text */
-		textwidth = drawtext(prompt->draw, &color[ColorFG], x, y, prompt->h, prompt->itemarray[n]->text, 0);
+		textwidth = drawmatch(prompt, color, x, y, &prompt->spans[n],
+		                      prompt->itemarray[n]->text, prompt->itemarray[n]->textlen);
 		textwidth = x + textwidth + dc.pad * 2;
 		textwidth = MAX(textwidth, prompt->descx);
 
 		/* if item has a description, draw it */
 		if (prompt->itemarray[n]->description != NULL)
 			drawtext(prompt->draw, &color[ColorCM], textwidth, y, prompt->h,
-			         prompt->itemarray[n]->description, 0);
+			         prompt->itemarray[n]->description, prompt->itemarray[n]->desclen);
 	} else {    /* item has description and dflag is on */
-		drawtext(prompt->draw, &color[ColorFG], x, y, prompt->h,
-		         prompt->itemarray[n]->description, 0);
+		drawmatch(prompt, color, x, y, &prompt->spans[n],
+		          prompt->itemarray[n]->description, prompt->itemarray[n]->desclen);
 	}
 
 	/* commit drawing */
@@ -802,7 +2392,6 @@ drawitem(struct Prompt *prompt, size_t n, int copy)
 static void
 drawprompt(struct Prompt *prompt)
 {
-	static size_t nitems = 0;       /* number of items in the dropdown list */
 	unsigned h;
 	size_t i;
 
@@ -815,10 +2404,10 @@ drawprompt(struct Prompt *prompt)
 	drawinput(prompt, 0);
 
 	/* resize window and get new value of number of items */
-	nitems = resizeprompt(prompt, nitems);
+	prompt->nitemswin = resizeprompt(prompt, prompt->nitemswin);
 
 	/* if there are no items to drawn, we are done */
-	if (!nitems)
+	if (!prompt->nitemswin)
 		goto done;
 
 	/* draw items */
@@ -873,14 +2462,14 @@ static size_t
 movewordedge(const char *text, size_t pos, int dir)
 {
 	if (dir < 0) {
-		while (pos > 0 && strchr(config.worddelimiters, text[nextrune(text, pos, -1)]))
+		while (pos > 0 && isdelim(text[nextrune(text, pos, -1)]))
 			pos = nextrune(text, pos, -1);
-		while (pos > 0 && !strchr(config.worddelimiters, text[nextrune(text, pos, -1)]))
+		while (pos > 0 && !isdelim(text[nextrune(text, pos, -1)]))
 			pos = nextrune(text, pos, -1);
 	} else {
-		while (text[pos] && strchr(config.worddelimiters, text[pos]))
+		while (text[pos] && isdelim(text[pos]))
 			pos = nextrune(text, pos, +1);
-		while (text[pos] && !strchr(config.worddelimiters, text[pos]))
+		while (text[pos] && !isdelim(text[pos]))
 			pos = nextrune(text, pos, +1);
 	}
 	return pos;
@@ -1115,6 +2704,7 @@ setpromptundo(struct Prompt *prompt)
 	prompt->undo->next = NULL;
 	prompt->undo->prev = NULL;
 	prompt->undocurr = NULL;
+	prompt->prevoperation = CTRLNOTHING;
 }
 
 /* allocate memory for the item list displayed when completion is active */
@@ -1127,7 +2717,24 @@ setpromptarray(struct Prompt *prompt)
 	prompt->matchlist = NULL;
 	prompt->maxitems = config.number_items;
 	prompt->nitems = 0;
+	prompt->nitemswin = 0;
 	prompt->itemarray = ecalloc(prompt->maxitems, sizeof *prompt->itemarray);
+	prompt->scores = ecalloc(prompt->maxitems, sizeof *prompt->scores);
+	prompt->spans = ecalloc(prompt->maxitems, sizeof *prompt->spans);
+	prompt->matchset = (struct MatchSet){.complist = NULL, .text = NULL, .len = 0, .textsize = 0,
+	                                     .matches = NULL, .tmp = NULL, .nmatches = 0, .nwordmatches = 0, .size = 0,
+	                                     .next = NULL, .pos = 0, .nlinked = 0, .last = NULL,
+	                                     .linked = NULL, .nlisted = 0, .linkedsize = 0, .listpos = 0,
+	                                     .parenthash = 0, .used = NULL, .nused = 0, .usedsize = 0,
+	                                     .ranked = NULL, .rankedsize = 0, .trigrams = NULL};
+	prompt->prefixes = NULL;
+	prompt->key = NULL;
+	prompt->keysize = 0;
+	prompt->ranks = NULL;
+	prompt->ranksize = 0;
+	prompt->stale = 0;
+	prompt->context = (struct Context){.text = NULL, .len = 0, .textsize = 0,
+	                                   .steps = NULL, .nsteps = 0, .maxsteps = 0};
 }
 
 /* calculate prompt geometry */
@@ -1253,6 +2860,7 @@ setpromptwin(struct Prompt *prompt, Window parentwin)
 	                            CWOverrideRedirect | CWBackPixel | CWBorderPixel,
 	                            &swa);
 	XSetClassHint(dpy, prompt->win, &classh);
+	prompt->intext = 0;
 
 	/* set window normal hints */
 	sizeh.flags = PMaxSize | PMinSize;
@@ -1284,28 +2892,32 @@ setpromptpix(struct Prompt *prompt)
 	XDrawLine(dpy, prompt->pixmap, dc.gc, 0, y, prompt->w, y);
 }
 
+/* open input method */
+static void
+initim(void)
+{
+	if ((ic.xim = XOpenIM(dpy, NULL, NULL, NULL)) == NULL)
+		errx(1, "XOpenIM: could not open input method");
+
+	/* set destroy callback for the input method, also used for the input context */
+	ic.destroy.client_data = NULL;
+	ic.destroy.callback = (XICProc)icdestroy;
+	if (XSetIMValues(ic.xim, XNDestroyCallback, &ic.destroy, NULL) != NULL)
+		warnx("XSetIMValues: could not set input method values");
+}
+
 /* setup prompt input context */
 static void
 setpromptic(struct Prompt *prompt)
 {
-	XICCallback start, done, draw, caret, destroy;
+	XICCallback start, done, draw, caret;
 	XVaNestedList preedit = NULL;
 	XIMStyles *imstyles;
 	XIMStyle preeditstyle;
 	XIMStyle statusstyle;
 	int i;
 
-	/* open input method */
-	if ((ic.xim = XOpenIM(dpy, NULL, NULL, NULL)) == NULL)
-		errx(1, "XOpenIM: could not open input method");
-
-	/* create callbacks for the input method */
-	destroy.client_data = NULL;
-	destroy.callback = (XICProc)icdestroy;
-
-	/* set destroy callback for the input method */
-	if (XSetIMValues(ic.xim, XNDestroyCallback, &destroy, NULL) != NULL)
-		warnx("XSetIMValues: could not set input method values");
+	ic.composing = 0;
 
 	/* get styles supported by input method */
 	if (XGetIMValues(ic.xim, XNQueryInputStyle, &imstyles, NULL) != NULL)
@@ -1346,7 +2958,7 @@ setpromptic(struct Prompt *prompt)
 	                   XNInputStyle, preeditstyle | statusstyle,
 	                   XNPreeditAttributes, preedit,
 	                   XNClientWindow, prompt->win,
-	                   XNDestroyCallback, &destroy,
+	                   XNDestroyCallback, &ic.destroy,
 	                   NULL);
 	if (ic.xic == NULL)
 		errx(1, "XCreateIC: could not obtain input method");
@@ -1456,9 +3068,9 @@ insert(struct Prompt *prompt, const char *str, ssize_t n)
 static void
 delword(struct Prompt *prompt)
 {
-	while (prompt->cursor > 0 && strchr(config.worddelimiters, prompt->text[nextrune(prompt->text, prompt->cursor, -1)]))
+	while (prompt->cursor > 0 && isdelim(prompt->text[nextrune(prompt->text, prompt->cursor, -1)]))
 		insert(prompt, NULL, nextrune(prompt->text, prompt->cursor, -1) - prompt->cursor);
-	while (prompt->cursor > 0 && !strchr(config.worddelimiters, prompt->text[nextrune(prompt->text, prompt->cursor, -1)]))
+	while (prompt->cursor > 0 && !isdelim(prompt->text[nextrune(prompt->text, prompt->cursor, -1)]))
 		insert(prompt, NULL, nextrune(prompt->text, prompt->cursor, -1) - prompt->cursor);
 }
 
@@ -1466,15 +3078,15 @@ delword(struct Prompt *prompt)
 static void
 insertselitem(struct Prompt *prompt)
 {
-	if (prompt->cursor && !strchr(config.worddelimiters, prompt->text[prompt->cursor - 1]))
+	if (prompt->cursor && !isdelim(prompt->text[prompt->cursor - 1]))
 		delword(prompt);
 	if (!filecomp) {        /* If not completing a file, insert item as is */
-		insert(prompt, prompt->selitem->text,
-		       strlen(prompt->selitem->text));
+		insert(prompt, prompt->selitem->text, prompt->selitem->textlen);
+		useitem(prompt->selitem);
 	} else if (prompt->file > 0) {
 		memmove(prompt->text + prompt->file, prompt->text + prompt->cursor, strlen(prompt->text + prompt->cursor) + 1);
 		prompt->cursor = prompt->file;
-		insert(prompt, prompt->selitem->text, strlen(prompt->selitem->text));
+		insert(prompt, prompt->selitem->text, prompt->selitem->textlen);
 	}
 }
 
@@ -1576,59 +3188,323 @@ done:
 		warnx("Error sending SelectionNotify event");
 }
 
-/* navigate through history */
-static char *
-navhist(struct History *hist, int direction)
+/* navigate through history */
+static char *
+navhist(struct History *hist, int direction)
+{
+	if (direction < 0) {
+		if (hist->index > 0)
+			hist->index--;
+	} else {
+		if (hist->index + 1 < hist->size)
+			hist->index++;
+	}
+
+	if (hist->index == hist->size)
+		return NULL;
+
+	return hist->entries[hist->index];
+}
+
+/* compare the strings of the items, ignoring case if -i was given; equal strings are sorted by position */
+static int
+prefixsort(const void *a, const void *b)
+{
+	const struct Match *p, *q;
+	const unsigned char *s, *t;
+	size_t i, slen, tlen;
+
+	p = (const struct Match *)a;
+	q = (const struct Match *)b;
+	s = (const unsigned char *)matchstring(p->item, &slen);
+	t = (const unsigned char *)matchstring(q->item, &tlen);
+	for (i = 0; i < slen && i < tlen; i++)
+		if (s[i] != t[i])
+			return s[i] - t[i];
+	if (slen != tlen)
+		return (slen < tlen) ? -1 : 1;
+	return (p->pos < q->pos) ? -1 : (p->pos > q->pos);
+}
+
+/* compare the matched string of item, as if it was cut to len bytes, with the len bytes of word */
+static int
+prefixcmp(struct Item *item, const char *word, size_t len)
+{
+	const unsigned char *s, *w;
+	size_t i, slen;
+
+	s = (const unsigned char *)matchstring(item, &slen);
+	w = (const unsigned char *)word;
+	for (i = 0; i < slen && i < len; i++)
+		if (s[i] != w[i])
+			return s[i] - w[i];
+	return (slen < len) ? -1 : 0;
+}
+
+/* get the index into sorted of the item between beg and end that comes first in the list */
+static size_t
+firstsorted(struct Match *sorted, size_t beg, size_t end, size_t first)
+{
+	size_t i;
+
+	for (i = beg; i < end; i++)
+		if (sorted[i].pos < sorted[first].pos)
+			first = i;
+	return first;
+}
+
+/*
+ * Index the nitems items of list by their strings.  The items are sorted
+ * by their strings, so the items beginning with a word are together.  The
+ * sorted items are split into blocks of PREFIXBLOCK items; for each range
+ * of 2^k blocks beginning at each block, the index has the item that comes
+ * first in the list, so only the blocks at the ends of a range are scanned.
+ */
+static struct Prefixes *
+buildprefixes(struct Item *list, size_t nitems)
+{
+	struct Prefixes *index;
+	struct Match *sorted;
+	struct Item *item;
+	uint32_t a, b;
+	size_t i, k, n;
+
+	index = emalloc(sizeof *index);
+	index->list = list;
+	index->nitems = nitems;
+	sorted = ecalloc(nitems, sizeof *sorted);
+	for (i = 0, item = list; i < nitems; i++, item = item->next) {
+		sorted[i].item = item;
+		sorted[i].pos = i;
+	}
+	qsort(sorted, nitems, sizeof *sorted, prefixsort);
+	index->sorted = sorted;
+	index->nblocks = (nitems + PREFIXBLOCK - 1) / PREFIXBLOCK;
+	for (index->nlevels = 1; ((size_t)1 << index->nlevels) <= index->nblocks; index->nlevels++)
+		;
+	index->firsts = ecalloc(index->nlevels, sizeof *index->firsts);
+	index->firsts[0] = ecalloc(index->nblocks, sizeof **index->firsts);
+	for (i = 0; i < index->nblocks; i++)
+		index->firsts[0][i] = firstsorted(sorted, i * PREFIXBLOCK + 1,
+		                                  MIN(nitems, (i + 1) * PREFIXBLOCK), i * PREFIXBLOCK);
+	for (k = 1; k < index->nlevels; k++) {
+		n = index->nblocks - ((size_t)1 << k) + 1;
+		index->firsts[k] = ecalloc(n, sizeof **index->firsts);
+		for (i = 0; i < n; i++) {
+			a = index->firsts[k - 1][i];
+			b = index->firsts[k - 1][i + ((size_t)1 << (k - 1))];
+			index->firsts[k][i] = (sorted[b].pos < sorted[a].pos) ? b : a;
+		}
+	}
+	return index;
+}
+
+/*
+ * Get the prefix index of list, building it the first time if the list
+ * has at least PREFIXSIZ items; or return NULL.
+ */
+static struct Prefixes *
+getprefixes(struct Prompt *prompt, struct Item *list)
+{
+	struct Prefixes *index;
+	struct Item *item;
+	size_t n;
+
+	/* lists being read change before the index pays off */
+	if (rflag)
+		return NULL;
+	for (n = 0, item = list; item != NULL && n < PREFIXSIZ; item = item->next)
+		n++;
+	if (n < PREFIXSIZ)
+		return NULL;
+	for (index = prompt->prefixes; index != NULL; index = index->next)
+		if (index->list == list)
+			return index;
+	for (; item != NULL; item = item->next)
+		n++;
+	if (n > UINT32_MAX)
+		return NULL;
+	index = buildprefixes(list, n);
+	index->next = prompt->prefixes;
+	prompt->prefixes = index;
+	return index;
+}
+
+/* find the first item of the list of index whose string begins with the len bytes of word, or NULL */
+static struct Item *
+findprefix(struct Prefixes *index, const char *word, size_t len)
+{
+	struct Match *sorted;
+	size_t lo, hi, mid, beg, first, fb, lb, a, b, k;
+
+	/* find the range of the sorted items beginning with word */
+	sorted = index->sorted;
+	for (lo = 0, hi = index->nitems; lo < hi; ) {
+		mid = lo + (hi - lo) / 2;
+		if (prefixcmp(sorted[mid].item, word, len) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	beg = lo;
+	for (hi = index->nitems; lo < hi; ) {
+		mid = lo + (hi - lo) / 2;
+		if (prefixcmp(sorted[mid].item, word, len) <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (beg == lo)
+		return NULL;
+
+	/* the whole blocks in the range are covered by two ranges of 2^k blocks, which may overlap */
+	fb = (beg + PREFIXBLOCK - 1) / PREFIXBLOCK;
+	lb = lo / PREFIXBLOCK;
+	if (fb >= lb)
+		return sorted[firstsorted(sorted, beg + 1, lo, beg)].item;
+	for (k = 0; ((size_t)2 << k) <= lb - fb; k++)
+		;
+	a = index->firsts[k][fb];
+	b = index->firsts[k][lb - ((size_t)1 << k)];
+	first = (sorted[b].pos < sorted[a].pos) ? b : a;
+
+	/* the items before and after the whole blocks are scanned */
+	first = firstsorted(sorted, beg, fb * PREFIXBLOCK, first);
+	first = firstsorted(sorted, lb * PREFIXBLOCK, lo, first);
+	return sorted[first].item;
+}
+
+/* free the prefix indices of the prompt */
+static void
+cleanprefixes(struct Prompt *prompt)
+{
+	struct Prefixes *index;
+	size_t k;
+
+	while ((index = prompt->prefixes) != NULL) {
+		prompt->prefixes = index->next;
+		for (k = 0; k < index->nlevels; k++)
+			free(index->firsts[k]);
+		free(index->firsts);
+		free(index->sorted);
+		free(index);
+	}
+}
+
+/* remember the list of items completed after the word of text ending at end */
+static void
+pushcontext(struct Context *ctx, const char *text, size_t end, struct Item *list, size_t nword, int found)
 {
-	if (direction < 0) {
-		if (hist->index > 0)
-			hist->index--;
-	} else {
-		if (hist->index + 1 < hist->size)
-			hist->index++;
-	}
+	struct Step *step;
 
-	if (hist->index == hist->size)
-		return NULL;
+	if (ctx->nsteps == ctx->maxsteps) {
+		ctx->maxsteps = ctx->maxsteps ? ctx->maxsteps * 2 : 16;
+		if ((ctx->steps = realloc(ctx->steps, ctx->maxsteps * sizeof *ctx->steps)) == NULL)
+			err(1, "realloc");
+	}
+	step = &ctx->steps[ctx->nsteps++];
+	step->end = end;
+	step->list = list;
+	step->nword = nword;
+	step->found = found;
+
+	/* the text is kept up to the delimiter (or the nul) after the word */
+	if (ctx->textsize < end + 1) {
+		ctx->textsize = end + 1;
+		if ((ctx->text = realloc(ctx->text, ctx->textsize)) == NULL)
+			err(1, "realloc");
+	}
+	memcpy(ctx->text + ctx->len, text + ctx->len, end + 1 - ctx->len);
+	ctx->len = end + 1;
+}
 
-	return hist->entries[hist->index];
+/*
+ * With -i, normalize the *len bytes of text into the key of the prompt, the
+ * same way the keys of the items are, and return it; or return text as is.
+ */
+static const char *
+normalizetext(struct Prompt *prompt, const char *text, size_t *len)
+{
+	size_t n;
+
+	if (fstrncmp != strncasecmp)
+		return text;
+	n = normalize(text, *len, NULL, NULL);
+	if (prompt->keysize < n + 1) {
+		prompt->keysize = n + 1;
+		if ((prompt->key = realloc(prompt->key, prompt->keysize)) == NULL)
+			err(1, "realloc");
+	}
+	*len = normalize(text, *len, prompt->key, NULL);
+	return prompt->key;
 }
 
 /* get list of possible completions */
 static struct Item *
 getcomplist(struct Prompt *prompt, struct Item *rootitem)
 {
+	struct Context *ctx;
+	struct Prefixes *index;
 	struct Item *item, *curritem;
-	char *beg, *text;
+	const char *word, *text;
+	char *beg;
 	size_t nword = 0;
-	size_t end, len;
+	size_t end, len, textlen, same;
 	int found = 0;
 
+	/* resume after the last word that was looked up before, if the text up to the delimiter after it is unchanged */
+	ctx = &prompt->context;
+	for (same = 0; same < ctx->len && prompt->text[same] == ctx->text[same]; same++)
+		;
+	while (ctx->nsteps > 0 && (ctx->steps[ctx->nsteps - 1].end >= same ||
+	                           ctx->steps[ctx->nsteps - 1].end >= prompt->cursor))
+		ctx->nsteps--;
+	ctx->len = (ctx->nsteps > 0) ? ctx->steps[ctx->nsteps - 1].end + 1 : 0;
+	if (ctx->nsteps > 0) {
+		end = ctx->steps[ctx->nsteps - 1].end;
+		curritem = ctx->steps[ctx->nsteps - 1].list;
+		nword = ctx->steps[ctx->nsteps - 1].nword;
+		found = ctx->steps[ctx->nsteps - 1].found;
+	} else {
+		end = 0;
+		curritem = rootitem;
+	}
+
 	/* find list of possible completions */
-	end = 0;
-	curritem = rootitem;
 	while (end < prompt->cursor) {
 		nword++;
 		beg = prompt->text + end;
-		while (*beg != '\0' && strchr(config.worddelimiters, *beg))
+		while (*beg != '\0' && isdelim(*beg))
 			beg++;
 		end = beg - prompt->text;
 		while (end != prompt->cursor && prompt->text[end] != '\0'
-			&& !strchr(config.worddelimiters, prompt->text[end]))
+			&& !isdelim(prompt->text[end]))
 			end++;
 		len = end - (beg - prompt->text);
-		if (end != prompt->cursor) {
+		word = (end != prompt->cursor) ? normalizetext(prompt, beg, &len) : beg;
+		if (end != prompt->cursor && (index = getprefixes(prompt, curritem)) != NULL) {
+			/* in a long list, the first item beginning with the word is looked up */
+			if ((item = findprefix(index, word, len)) != NULL) {
+				if (aflag && item->child == NULL && curritem != rootitem)
+					return curritem;
+				curritem = item->child;
+				found = 1;
+			}
+		} else if (end != prompt->cursor) {
 			for (item = curritem; item != NULL; item = item->next) {
-				text = (dflag && item->description) ? item->description : item->text;
-				if ((*fstrncmp)(text, beg, len) == 0) {
-					if (aflag && item->child == NULL && curritem != rootitem)
-						return curritem;
-					curritem = item->child;
-					found = 1;
+				text = matchstring(item, &textlen);
+				if (textlen >= len && memcmp(text, word, len) == 0)
 					break;
-				}
+			}
+			if (item != NULL) {
+				if (aflag && item->child == NULL && curritem != rootitem)
+					return curritem;
+				curritem = item->child;
+				found = 1;
 			}
 		}
+		if (end != prompt->cursor)
+			pushcontext(ctx, prompt->text, end, curritem, nword, found);
 	}
 
 	if (!found && nword > 1)
@@ -1668,9 +3544,13 @@ getfilelist(struct Prompt *prompt)
 
 	glob(buf, 0, NULL, &g);
 
+	/* the previous list of file completions is not used anymore */
+	cleanarena(&filearena);
+
 	previtem = NULL;
 	for (i = 0; i < g.gl_pathc; i++) {
-		item = allocitem(g.gl_pathv[i], NULL);
+		len = strlen(g.gl_pathv[i]);
+		item = allocitem(&filearena, arenastrndup(&filearena, g.gl_pathv[i], len), len, NULL, 0);
 		if (previtem) {
 			item->prev = previtem;
 			previtem->next = item;
@@ -1680,59 +3560,931 @@ getfilelist(struct Prompt *prompt)
 		previtem = item;
 	}
 
-	globfree(&g);
+	globfree(&g);
+
+	return complist;
+}
+
+/* check whether the n bytes at s and t are equal, ignoring case if fold is nonzero */
+static int
+bytesequal(const char *s, const char *t, size_t n, int fold)
+{
+	size_t i;
+
+	if (!fold)
+		return memcmp(s, t, n) == 0;
+	for (i = 0; i < n; i++)
+		if (FOLD(s[i], fold) != FOLD(t[i], fold))
+			return 0;
+	return 1;
+}
+
+#ifdef __SSE2__
+/* convert the ASCII capital letters in v to lowercase */
+static __m128i
+foldvector(__m128i v)
+{
+	__m128i upper;
+
+	/* bytes from 0x80 are negative, and are not folded */
+	upper = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A' - 1)),
+	                      _mm_cmplt_epi8(v, _mm_set1_epi8('Z' + 1)));
+	return _mm_or_si128(v, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+#endif
+
+/*
+ * Return where text first occurs in the len bytes at s, or -1 if it does
+ * not, ignoring case if fold is nonzero.  With SSE2, the first and last bytes of text are compared
+ * against 16 positions of s at once, and text is compared in whole only
+ * at the positions where both are equal.  Case is folded in the vectors
+ * only for ASCII letters, so a text beginning or ending with other bytes
+ * is looked for one position at a time.
+ */
+static ssize_t
+findtext(const char *s, size_t len, const char *text, size_t textlen, int fold)
+{
+	const char *p;
+	size_t i, n;
+	int c;
+#ifdef __SSE2__
+	__m128i first, last, a, b;
+	unsigned mask;
+#endif
+
+	if (len == 0 || textlen > len)
+		return -1;
+	if (textlen == 0)
+		return 0;
+	n = len - textlen + 1;          /* number of positions text can be at */
+	i = 0;
+#ifdef __SSE2__
+	if (!fold || ((unsigned char)text[0] < 0x80 && (unsigned char)text[textlen - 1] < 0x80)) {
+		first = _mm_set1_epi8(fold ? tolower((unsigned char)text[0]) : text[0]);
+		last = _mm_set1_epi8(fold ? tolower((unsigned char)text[textlen - 1]) : text[textlen - 1]);
+		for (; i + 16 <= n; i += 16) {
+			a = _mm_loadu_si128((const __m128i *)(s + i));
+			b = _mm_loadu_si128((const __m128i *)(s + i + textlen - 1));
+			if (fold) {
+				a = foldvector(a);
+				b = foldvector(b);
+			}
+			mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+			for (; mask != 0; mask &= mask - 1)
+				if (bytesequal(s + i + __builtin_ctz(mask), text, textlen, fold))
+					return i + __builtin_ctz(mask);
+		}
+	}
+#endif
+	if (!fold) {
+		while (i < n && (p = memchr(s + i, text[0], n - i)) != NULL) {
+			if (memcmp(p, text, textlen) == 0)
+				return p - s;
+			i = p - s + 1;
+		}
+		return -1;
+	}
+	c = FOLD(text[0], fold);
+	for (; i < n; i++)
+		if (FOLD(s[i], fold) == c && bytesequal(s + i + 1, text + 1, textlen - 1, fold))
+			return i;
+	return -1;
+}
+
+/*
+ * Get where the len bytes at offset pos of the matched string of item are
+ * in its listed string.  The end is rounded up to the end of a character,
+ * as the text can match part of the bytes of the key a character expands to.
+ */
+static void
+mapspan(struct Item *item, size_t pos, size_t len, struct Span *span)
+{
+	size_t k;
+
+	if (item->keymap == NULL) {
+		span->beg = pos;
+		span->end = pos + len;
+		return;
+	}
+	k = pos + len;
+	if (len > 0)
+		while (k < item->keylen && item->keymap[k] == item->keymap[k - 1])
+			k++;
+	span->beg = item->keymap[pos];
+	span->end = item->keymap[k];
+}
+
+/* check whether a key press is waiting in the event queue, without removing any event */
+static Bool
+iskeypress(Display *dpy, XEvent *ev, XPointer arg)
+{
+	(void)dpy;
+	if (ev->type == KeyPress)
+		*(int *)arg = 1;
+	return False;
+}
+
+/*
+ * Count n more items as matched and, every CANCELSIZ of them, check
+ * whether a key was pressed; the text being matched is then obsolete,
+ * and matching gives up so the key is handled.  Return nonzero if it
+ * gave up.
+ */
+static int
+checkcancel(size_t n)
+{
+	static size_t count = 0;
+	XEvent ev;
+	int found;
+
+	if (cancelled || !cancellable)
+		return cancelled;
+	if ((count += n) < CANCELSIZ)
+		return 0;
+	count = 0;
+	found = 0;
+	if (XEventsQueued(dpy, QueuedAfterReading) > 0)
+		XCheckIfEvent(dpy, &ev, iskeypress, (XPointer)&found);
+	cancelled = found;
+	return cancelled;
+}
+
+/* return where text matches in the matched string of item, or -1 if it does not */
+static ssize_t
+itemmatch(struct Item *item, const char *text, size_t textlen, int middle)
+{
+	int (*cmp)(const char *, const char *, size_t);
+	const char *s, *p, *end;
+	size_t i, len;
+
+	/* the key of an item is compared with the text normalized the same way */
+	cmp = (item->key != NULL) ? strncmp : fstrncmp;
+	s = matchstring(item, &len);
+	if (middle)
+		return findtext(s, len, text, textlen, cmp == strncasecmp);
+	if (item->nwords > 0) {
+		for (i = 0; i < item->nwords && len - item->words[i] >= textlen; i++)
+			if ((*cmp)(s + item->words[i], text, textlen) == 0)
+				return item->words[i];
+		return -1;
+	}
+	end = s + len;
+	for (p = s; p < end && (size_t)(end - p) >= textlen; p = skipdelim(skipdelim(p, end, 0), end, 1))
+		if ((*cmp)(p, text, textlen) == 0)
+			return p - s;
+
+	return -1;
+}
+
+/*
+ * Score how well the text matches the query as a subsequence, or return
+ * INT_MIN if it does not; a match with long gaps scores below zero.  The
+ * first pass, which finds where the earliest occurrence of the query ends,
+ * is cheap and rejects most items; only items that match are scored, on
+ * their shortest occurrence ending there, which is returned in *beg_ret
+ * and *end_ret.
+ */
+static int
+fuzzyscore(const char *s, size_t len, const char *query, size_t qlen, int fold, size_t *beg_ret, size_t *end_ret)
+{
+	const char *p;
+	size_t i, j, beg, end;
+	int score, run;
+
+	if (len < qlen)
+		return INT_MIN;
+	if (fold) {
+		for (i = 0, j = 0; i < len && j < qlen; i++)
+			if (FOLD(s[i], fold) == FOLD(query[j], fold))
+				j++;
+		if (j < qlen)
+			return INT_MIN;
+	} else {
+		for (i = 0, j = 0; j < qlen; i = p - s + 1, j++)
+			if ((p = memchr(s + i, query[j], len - i)) == NULL)
+				return INT_MIN;
+	}
+	end = i;
+	for (j = qlen; j > 0; )
+		if (FOLD(s[--i], fold) == FOLD(query[j - 1], fold))
+			j--;
+	beg = i;
+
+	/* reward characters at the beginning of words and in runs; penalize gaps */
+	score = 0;
+	run = 0;
+	for (i = beg, j = 0; i < end; i++) {
+		if (j < qlen && FOLD(s[i], fold) == FOLD(query[j], fold)) {
+			score += FUZZYMATCH;
+			if (i == 0 || isdelim(s[i - 1]))
+				score += FUZZYWORD;
+			if (run)
+				score += FUZZYRUN;
+			run = 1;
+			j++;
+		} else {
+			score -= FUZZYGAP;
+			run = 0;
+		}
+	}
+	*beg_ret = beg;
+	*end_ret = end;
+	return score;
+}
+
+/* compare the items chosen before by their hashes */
+static int
+usedsort(const void *a, const void *b)
+{
+	const struct Used *ua = a, *ub = b;
+
+	return (ua->hash > ub->hash) - (ua->hash < ub->hash);
+}
+
+/*
+ * Get the items of complist chosen before from the records of the usage
+ * file whose parent is that of complist, rather than from the items of
+ * the list, which can be long.  The items are looked up among them by
+ * their hashes as they match, so only the items that match are hashed.
+ */
+static void
+getused(struct MatchSet *set, struct Item *complist)
+{
+	size_t i;
+
+	set->parenthash = (complist->parent != NULL) ? pathhash(complist->parent) : HASHSEED;
+	set->nused = 0;
+	for (i = 0; i < usefile.nrecords; i++) {
+		if (usefile.records[i].parent != set->parenthash)
+			continue;
+		if (set->nused == set->usedsize) {
+			set->usedsize = set->usedsize ? set->usedsize * 2 : 64;
+			if ((set->used = realloc(set->used, set->usedsize * sizeof *set->used)) == NULL)
+				err(1, "realloc");
+		}
+		set->used[set->nused].hash = usefile.records[i].hash;
+		set->used[set->nused++].frecency = frecency(&usefile.records[i]);
+	}
+	qsort(set->used, set->nused, sizeof *set->used, usedsort);
+}
+
+/* score how frecently item, of the list matched, was chosen; zero if it never was */
+static unsigned
+usedfrecency(struct MatchSet *set, struct Item *item)
+{
+	uint64_t h;
+	size_t lo, hi, mid;
+
+	if (set->nused == 0)
+		return 0;
+	h = itemhash(set->parenthash, item);
+	for (lo = 0, hi = set->nused; lo < hi; ) {
+		mid = lo + (hi - lo) / 2;
+		if (set->used[mid].hash < h)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (lo < set->nused && set->used[lo].hash == h) ? set->used[lo].frecency : 0;
+}
+
+/* grow the array of linked items to hold at least n of them */
+static void
+growlinked(struct MatchSet *set, size_t n)
+{
+	if (set->linkedsize >= n)
+		return;
+	set->linkedsize = MAX(n, set->linkedsize * 2);
+	if ((set->linked = realloc(set->linked, set->linkedsize * sizeof *set->linked)) == NULL)
+		err(1, "realloc");
+}
+
+/* grow the array of ranks to hold at least n of them */
+static void
+growranks(struct Prompt *prompt, size_t n)
+{
+	if (prompt->ranksize >= n)
+		return;
+	prompt->ranksize = MAX(n, prompt->ranksize * 2);
+	if ((prompt->ranks = realloc(prompt->ranks, prompt->ranksize * sizeof *prompt->ranks)) == NULL)
+		err(1, "realloc");
+}
+
+/* create list of the best items matching text fuzzily, as many as the dropdown list can show */
+static void
+fuzzymatchlist(struct Prompt *prompt, struct Item *complist, const char *text, size_t textlen)
+{
+	struct Item *item;
+	const char *s;
+	size_t i, n, len, beg, end;
+	unsigned f;
+	int score, fold;
+
+	/*
+	 * keep the best items in .ranks, by decreasing score; ties are broken
+	 * by how frecently the items were chosen, then by their order.  The
+	 * list shown is only replaced once all the items are scored, so it is
+	 * left as is if matching gives up.
+	 */
+	fold = (fstrncmp == strncasecmp);
+	growranks(prompt, prompt->maxitems);
+	n = 0;
+	for (item = complist; prompt->maxitems > 0 && item && !checkcancel(1); item = item->next) {
+		s = matchstring(item, &len);
+		if ((score = fuzzyscore(s, len, text, textlen, fold && item->key == NULL, &beg, &end)) == INT_MIN)
+			continue;
+		if (n == prompt->maxitems && score < prompt->scores[n - 1])
+			continue;
+		f = usedfrecency(&prompt->matchset, item);
+		if (n == prompt->maxitems && score == prompt->scores[n - 1] && f <= prompt->ranks[n - 1].frecency)
+			continue;
+		for (i = MIN(n, prompt->maxitems - 1); i > 0; i--) {
+			if (prompt->scores[i - 1] > score ||
+			    (prompt->scores[i - 1] == score && prompt->ranks[i - 1].frecency >= f))
+				break;
+			prompt->ranks[i] = prompt->ranks[i - 1];
+			prompt->scores[i] = prompt->scores[i - 1];
+		}
+		prompt->ranks[i].item = item;
+		prompt->ranks[i].frecency = f;
+		prompt->ranks[i].beg = beg;
+		prompt->ranks[i].end = end;
+		prompt->scores[i] = score;
+		if (n < prompt->maxitems)
+			n++;
+	}
+	if (cancelled)
+		return;
+
+	/* link them into the list of matched items */
+	growlinked(&prompt->matchset, n);
+	for (i = 0; i < n; i++) {
+		prompt->ranks[i].item->prevmatch = (i > 0) ? prompt->ranks[i - 1].item : NULL;
+		prompt->ranks[i].item->nextmatch = (i + 1 < n) ? prompt->ranks[i + 1].item : NULL;
+		prompt->matchset.linked[i].item = prompt->ranks[i].item;
+		prompt->matchset.linked[i].beg = prompt->ranks[i].beg;
+		prompt->matchset.linked[i].end = prompt->ranks[i].end;
+	}
+	prompt->matchset.nlisted = n;
+	prompt->firstmatch = (n > 0) ? prompt->ranks[0].item : NULL;
+	prompt->matchlist = prompt->firstmatch;
+	prompt->selitem = prompt->firstmatch;
+}
+
+/* double the size of the arrays of matches */
+static void
+growmatches(struct MatchSet *set)
+{
+	set->size = set->size ? set->size * 2 : 64;
+	set->matches = realloc(set->matches, set->size * sizeof *set->matches);
+	set->tmp = realloc(set->tmp, set->size * sizeof *set->tmp);
+	if (set->matches == NULL || set->tmp == NULL)
+		err(1, "realloc");
+}
+
+/* classify how item matches text, and get where it does in *off */
+static int
+matchclass(struct Item *item, const char *text, size_t len, uint32_t *off)
+{
+	ssize_t pos;
+
+	if ((pos = itemmatch(item, text, len, 0)) != -1) {
+		*off = pos;
+		return WordMatch;
+	}
+	if ((pos = itemmatch(item, text, len, 1)) != -1) {
+		*off = pos;
+		return MiddleMatch;
+	}
+	return NoMatch;
+}
+
+/* classify how each item of a chunk of a list matches the text */
+static void
+classifychunk(struct Classify *chunk)
+{
+	struct Item *item;
+	size_t i;
+
+	for (i = 0, item = chunk->beg; i < chunk->nitems; i++, item = item->next)
+		chunk->classes[i] = matchclass(item, chunk->text, chunk->len, &chunk->offsets[i]);
+}
+
+/* classify the chunks posted to the pool, until the process exits */
+static void *
+poolthread(void *arg)
+{
+	struct Classify *chunk;
+
+	(void)arg;
+	pthread_mutex_lock(&pool.mutex);
+	for (;;) {
+		while (pool.next == pool.nchunks)
+			pthread_cond_wait(&pool.work, &pool.mutex);
+		chunk = &pool.chunks[pool.next++];
+		pthread_mutex_unlock(&pool.mutex);
+		classifychunk(chunk);
+		pthread_mutex_lock(&pool.mutex);
+		if (--pool.pending == 0)
+			pthread_cond_signal(&pool.done);
+	}
+	return NULL;
+}
+
+/* start the threads of the pool, one for each cpu besides the one matching the list */
+static void
+startpool(void)
+{
+	size_t i;
+	long ncpus;
+
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	pool.maxchunks = (ncpus > 1) ? MIN((size_t)ncpus, MAXTHREADS) : 1;
+	pool.chunks = ecalloc(pool.maxchunks, sizeof *pool.chunks);
+	pool.classes = emalloc(pool.maxchunks * MATCHSIZ);
+	pool.offsets = ecalloc(pool.maxchunks * MATCHSIZ, sizeof *pool.offsets);
+	pool.threads = ecalloc(pool.maxchunks, sizeof *pool.threads);
+	pool.nchunks = pool.next = pool.pending = 0;
+	pthread_mutex_init(&pool.mutex, NULL);
+	pthread_cond_init(&pool.work, NULL);
+	pthread_cond_init(&pool.done, NULL);
+
+	/* chunks left by threads that could not be created are classified by the thread matching the list */
+	for (i = 1; i < pool.maxchunks; i++)
+		if (pthread_create(&pool.threads[pool.nthreads], NULL, poolthread, NULL) == 0)
+			pool.nthreads++;
+	pool.started = 1;
+}
+
+/*
+ * Classify how the items from beg on match text, in parallel, in chunks of
+ * MATCHSIZ items, one for each thread of the pool and one for this thread.
+ * The list is split into chunks as it is walked, so it is not counted
+ * first; return how each item matches, where it does in *offsets_ret, and
+ * their number in *nitems_ret.
+ */
+static unsigned char *
+classifyitems(struct Item *beg, const char *text, size_t len, uint32_t **offsets_ret, size_t *nitems_ret)
+{
+	struct Classify *chunk;
+	struct Item *item;
+	size_t nchunks, i, j;
+
+	if (!pool.started)
+		startpool();
+
+	/* the threads are waiting for chunks, so the chunks can be written without the lock */
+	for (nchunks = 0, i = 0, item = beg; item != NULL && nchunks < pool.maxchunks; nchunks++) {
+		pool.chunks[nchunks].beg = item;
+		pool.chunks[nchunks].text = text;
+		pool.chunks[nchunks].len = len;
+		pool.chunks[nchunks].classes = pool.classes + i;
+		pool.chunks[nchunks].offsets = pool.offsets + i;
+		for (j = 0; item != NULL && j < MATCHSIZ; j++)
+			item = item->next;
+		pool.chunks[nchunks].nitems = j;
+		i += j;
+	}
+	*offsets_ret = pool.offsets;
+	*nitems_ret = i;
+
+	/* post the chunks, and classify them along with the threads */
+	pthread_mutex_lock(&pool.mutex);
+	pool.nchunks = pool.pending = nchunks;
+	pool.next = 0;
+	pthread_cond_broadcast(&pool.work);
+	while (pool.next < pool.nchunks) {
+		chunk = &pool.chunks[pool.next++];
+		pthread_mutex_unlock(&pool.mutex);
+		classifychunk(chunk);
+		pthread_mutex_lock(&pool.mutex);
+		pool.pending--;
+	}
+	while (pool.pending > 0)
+		pthread_cond_wait(&pool.done, &pool.mutex);
+	pool.nchunks = pool.next = 0;
+	pthread_mutex_unlock(&pool.mutex);
+
+	return pool.classes;
+}
+
+/* get the bucket of the trigram at s, whose case is folded */
+static size_t
+trigrambucket(const char *s)
+{
+	uint32_t h;
+
+	h = (uint32_t)FOLD(s[0], 1) << 16 | (uint32_t)FOLD(s[1], 1) << 8 | (uint32_t)FOLD(s[2], 1);
+	return (uint32_t)(h * 0x9E3779B1) >> (32 - TRIGRAMBITS);
+}
+
+/*
+ * Index the nitems items of complist by the trigrams (sequences of three
+ * bytes) in their strings.  For each bucket of trigrams, the index has the
+ * positions of the items containing one of them, in increasing order.
+ * Case is folded, so the same index is used whether case is ignored or not.
+ */
+static struct Trigrams *
+buildtrigrams(struct Item *complist, size_t nitems)
+{
+	struct Trigrams *index;
+	struct Item *item;
+	uint32_t *mark;
+	const char *s;
+	size_t pos, i, b, len, n;
+
+	index = emalloc(sizeof *index);
+	index->complist = complist;
+	index->nitems = nitems;
+	index->items = ecalloc(nitems, sizeof *index->items);
+	index->offsets = ecalloc(TRIGRAMBUCKETS + 1, sizeof *index->offsets);
+	mark = ecalloc(TRIGRAMBUCKETS, sizeof *mark);
+
+	/* count the items in each bucket, each item once */
+	for (pos = 0, item = complist; item != NULL; item = item->next, pos++) {
+		index->items[pos] = item;
+		s = matchstring(item, &len);
+		for (i = 0; i + 2 < len; i++) {
+			b = trigrambucket(s + i);
+			if (mark[b] != pos + 1) {
+				mark[b] = pos + 1;
+				index->offsets[b + 1]++;
+			}
+		}
+	}
+	for (b = 0; b < TRIGRAMBUCKETS; b++)
+		index->offsets[b + 1] += index->offsets[b];
+
+	/* fill the buckets, using the offsets of the next buckets as cursors */
+	index->postings = ecalloc(MAX(index->offsets[TRIGRAMBUCKETS], 1), sizeof *index->postings);
+	memset(mark, 0, TRIGRAMBUCKETS * sizeof *mark);
+	for (pos = 0; pos < nitems; pos++) {
+		s = matchstring(index->items[pos], &len);
+		for (i = 0; i + 2 < len; i++) {
+			b = trigrambucket(s + i);
+			if (mark[b] != pos + 1) {
+				mark[b] = pos + 1;
+				index->postings[index->offsets[b]++] = pos;
+			}
+		}
+	}
+	for (n = 0, b = 0; b < TRIGRAMBUCKETS; b++) {
+		i = index->offsets[b];
+		index->offsets[b] = n;
+		n = i;
+	}
+	free(mark);
+
+	return index;
+}
+
+/*
+ * Get the trigram index of complist, building it the first time if the
+ * list is long enough; or return NULL.  The number of items of the list
+ * is returned in *nitems.
+ */
+static struct Trigrams *
+gettrigrams(struct MatchSet *set, struct Item *complist, size_t *nitems)
+{
+	struct Trigrams *index;
+	struct Item *item;
+
+	for (index = set->trigrams; index != NULL; index = index->next) {
+		if (index->complist == complist) {
+			*nitems = index->nitems;
+			return index;
+		}
+	}
+	for (*nitems = 0, item = complist; item; item = item->next)
+		(*nitems)++;
+
+	/* lists being read, and lists of files, change before the index pays off */
+	if (*nitems < TRIGRAMSIZ || *nitems >= UINT32_MAX || rflag || filecomp)
+		return NULL;
+	index = buildtrigrams(complist, *nitems);
+	index->next = set->trigrams;
+	set->trigrams = index;
+	return index;
+}
+
+/*
+ * Return the positions, in increasing order, of the items that contain all
+ * the trigrams of text (and maybe others, of the same buckets), and their
+ * number in *n.  Only they can match text, which has at least three bytes.
+ */
+static uint32_t *
+trigramcandidates(struct Trigrams *index, const char *text, size_t len, size_t *n)
+{
+	uint32_t *cand, *list;
+	size_t i, j, k, b, min, nlist, ncand, lo, hi, mid;
+
+	/* begin with the shortest posting list */
+	for (min = b = trigrambucket(text), i = 1; i + 2 < len; i++) {
+		b = trigrambucket(text + i);
+		if (index->offsets[b + 1] - index->offsets[b] < index->offsets[min + 1] - index->offsets[min])
+			min = b;
+	}
+	ncand = index->offsets[min + 1] - index->offsets[min];
+	cand = emalloc(MAX(ncand, 1) * sizeof *cand);
+	memcpy(cand, index->postings + index->offsets[min], ncand * sizeof *cand);
+
+	/* keep the candidates in the other lists, looking each one up after the previous one */
+	for (i = 0; i + 2 < len && ncand > 0; i++) {
+		if ((b = trigrambucket(text + i)) == min)
+			continue;
+		list = index->postings + index->offsets[b];
+		nlist = index->offsets[b + 1] - index->offsets[b];
+		for (lo = 0, j = k = 0; j < ncand; j++) {
+			for (hi = nlist; lo < hi; ) {
+				mid = lo + (hi - lo) / 2;
+				if (list[mid] < cand[j])
+					lo = mid + 1;
+				else
+					hi = mid;
+			}
+			if (lo == nlist)
+				break;
+			if (list[lo] == cand[j])
+				cand[k++] = cand[j];
+		}
+		ncand = k;
+	}
+	*n = ncand;
+	return cand;
+}
+
+/* free the trigram indices of the set of matches */
+static void
+cleantrigrams(struct MatchSet *set)
+{
+	struct Trigrams *index;
+
+	while ((index = set->trigrams) != NULL) {
+		set->trigrams = index->next;
+		free(index->items);
+		free(index->offsets);
+		free(index->postings);
+		free(index);
+	}
+}
+
+/* append item, at position pos of its list and matching at off, to the matches of its class, with how frecently it was chosen */
+static void
+appendmatch(struct MatchSet *set, struct Item *item, size_t pos, int class, uint32_t off, size_t *nword, size_t *nmiddle)
+{
+	struct Match *match;
+
+	if (class == NoMatch)
+		return;
+	if (*nword + *nmiddle == set->size)
+		growmatches(set);
+	match = (class == WordMatch) ? &set->matches[(*nword)++] : &set->tmp[(*nmiddle)++];
+	match->item = item;
+	match->pos = pos;
+	match->off = off;
+	match->frecency = usedfrecency(set, item);
+}
+
+/*
+ * Add to the set of matches the items from set->next on that match text,
+ * until want items match it at the beginning of a word; set->next is left
+ * at the first item not classified, or NULL once all of them are.  Only
+ * the items matching at the beginning of a word can be listed before the
+ * list is classified to its end, so a short text (which matches most
+ * items) does not classify the whole list to fill the dropdown list.  If
+ * the items matching are sparse, the rest of the list is classified at
+ * once, by several threads.
+ */
+static void
+scanmatches(struct MatchSet *set, const char *text, size_t len, size_t want)
+{
+	struct Item *item;
+	unsigned char *classes;
+	uint32_t *offsets, off;
+	size_t i, pos, nitems, nword, nmiddle;
+	int class;
+
+	if (set->next == NULL)
+		return;
+	nword = set->nwordmatches;
+	nmiddle = set->nmatches - nword;
+	if (nmiddle > 0)
+		memcpy(set->tmp, set->matches + nword, nmiddle * sizeof *set->tmp);
+	for (i = 0, pos = set->pos, item = set->next;
+	     item && nword < want && i < MATCHSIZ && !checkcancel(1);
+	     i++, pos++, item = item->next) {
+		class = matchclass(item, text, len, &off);
+		appendmatch(set, item, pos, class, off, &nword, &nmiddle);
+	}
+
+	/* the rest is classified in rounds, each one by the threads, so matching can give up between them */
+	while (item && nword < want && !cancelled) {
+		classes = classifyitems(item, text, len, &offsets, &nitems);
+		for (i = 0; i < nitems; i++, pos++, item = item->next)
+			appendmatch(set, item, pos, classes[i], offsets[i], &nword, &nmiddle);
+		checkcancel(nitems);
+	}
+	if (nmiddle > 0)
+		memcpy(set->matches + nword, set->tmp, nmiddle * sizeof *set->tmp);
+	set->nmatches = nword + nmiddle;
+	set->nwordmatches = nword;
+	set->next = item;
+	set->pos = pos;
+}
+
+/*
+ * Fill the set of matches with the items of complist matching text, in a
+ * single pass: each item is classified as it is visited, the items that
+ * match at the beginning of a word are appended to the matches and those
+ * that match only in the middle are gathered after them.  In a long list,
+ * only the items having the trigrams of text are visited; otherwise, the
+ * items are visited until want of them match at the beginning of a word.
+ */
+static void
+matchitems(struct MatchSet *set, struct Item *complist, const char *text, size_t len, size_t want)
+{
+	struct Trigrams *index;
+	struct Item *item;
+	uint32_t *cand, off;
+	size_t i, nitems, ncand, nword, nmiddle;
+	int class;
+
+	set->nmatches = set->nwordmatches = 0;
+	set->next = complist;
+	set->pos = 0;
+	if (len < 3 || (index = gettrigrams(set, complist, &nitems)) == NULL) {
+		scanmatches(set, text, len, want);
+		return;
+	}
+	nword = nmiddle = 0;
+	cand = trigramcandidates(index, text, len, &ncand);
+	for (i = 0; i < ncand && !checkcancel(1); i++) {
+		item = index->items[cand[i]];
+		class = matchclass(item, text, len, &off);
+		appendmatch(set, item, cand[i], class, off, &nword, &nmiddle);
+	}
+	free(cand);
+	if (nmiddle > 0)
+		memcpy(set->matches + nword, set->tmp, nmiddle * sizeof *set->tmp);
+	set->nmatches = nword + nmiddle;
+	set->nwordmatches = nword;
+	set->next = NULL;
+}
+
+/* return the first of the matches from i to n that matches text in the middle, where it does, or n */
+static size_t
+nextmiddlematch(struct Match *matches, size_t i, size_t n, const char *text, size_t len)
+{
+	ssize_t off;
+
+	for (; i < n && !checkcancel(1); i++) {
+		if ((off = itemmatch(matches[i].item, text, len, 1)) != -1) {
+			matches[i].off = off;
+			break;
+		}
+	}
+	return i;
+}
+
+/*
+ * Refine the set of matches of the last text into the set of matches of
+ * text, which extends it.  An item that matches text at the beginning of
+ * a word matched the last text there too; and an item that matches text
+ * only in the middle matched the last text either way.  The latter are
+ * merged by their position, so they are listed in the same order as when
+ * all the items are matched.
+ */
+static void
+refinematches(struct MatchSet *set, const char *text, size_t len)
+{
+	struct Match *tmp;
+	size_t i, j, n, nword, ndemoted;
+	ssize_t off;
+
+	/* keep the word matches that still match; the others are moved to the beginning */
+	n = ndemoted = 0;
+	for (i = 0; i < set->nwordmatches && !checkcancel(1); i++) {
+		if ((off = itemmatch(set->matches[i].item, text, len, 0)) != -1) {
+			set->tmp[n] = set->matches[i];
+			set->tmp[n++].off = off;
+		} else {
+			set->matches[ndemoted++] = set->matches[i];
+		}
+	}
+	nword = n;
+
+	/* merge the moved items and the middle matches that still match in the middle */
+	i = nextmiddlematch(set->matches, 0, ndemoted, text, len);
+	j = nextmiddlematch(set->matches, set->nwordmatches, set->nmatches, text, len);
+	while ((i < ndemoted || j < set->nmatches) && !cancelled) {
+		if (j == set->nmatches || (i < ndemoted && set->matches[i].pos < set->matches[j].pos)) {
+			set->tmp[n++] = set->matches[i];
+			i = nextmiddlematch(set->matches, i + 1, ndemoted, text, len);
+		} else {
+			set->tmp[n++] = set->matches[j];
+			j = nextmiddlematch(set->matches, j + 1, set->nmatches, text, len);
+		}
+	}
+
+	tmp = set->matches;
+	set->matches = set->tmp;
+	set->tmp = tmp;
+	set->nmatches = n;
+	set->nwordmatches = nword;
+}
+
+/* compare ranked matches by decreasing frecency, then by their position */
+static int
+ranksort(const void *a, const void *b)
+{
+	const struct Rank *ra = a, *rb = b;
+
+	if (ra->frecency != rb->frecency)
+		return (ra->frecency < rb->frecency) ? 1 : -1;
+	return (ra->pos > rb->pos) - (ra->pos < rb->pos);
+}
+
+/* append item to the list of matched items from *first to *last */
+static void
+linkmatch(struct Item **first, struct Item **last, struct Item *item)
+{
+	item->prevmatch = *last;
+	item->nextmatch = NULL;
+	if (*last != NULL)
+		(*last)->nextmatch = item;
+	else
+		*first = item;
+	*last = item;
+}
 
-	return complist;
+/* append the ith match, of the len bytes of text, to the list of matched items from *first to *last */
+static void
+linkmatched(struct MatchSet *set, size_t i, size_t len, struct Item **first, struct Item **last)
+{
+	struct Linked *linked;
+
+	linkmatch(first, last, set->matches[i].item);
+	growlinked(set, set->nlisted + 1);
+	linked = &set->linked[set->nlisted++];
+	linked->item = set->matches[i].item;
+	linked->beg = set->matches[i].off;
+	linked->end = set->matches[i].off + len;
 }
 
-/* check whether item matches text */
-static int
-itemmatch(struct Item *item, const char *text, size_t textlen, int middle)
+/*
+ * Link the matches from beg to end, of the len bytes of text, into the
+ * list of matched items from *first to *last: those chosen before first,
+ * by decreasing frecency, and then the others, in order.
+ */
+static void
+linkrange(struct MatchSet *set, size_t beg, size_t end, size_t len, struct Item **first, struct Item **last)
 {
-	const char *s;
+	size_t i, n;
 
-	s = (dflag && item->description) ? item->description : item->text;
-	while (*s) {
-		if ((*fstrncmp)(s, text, textlen) == 0)
-			return 1;
-		if (middle) {
-			s++;
-		} else {
-			while (*s && strchr(config.worddelimiters, *s) == NULL)
-				s++;
-			while (*s && strchr(config.worddelimiters, *s) != NULL)
-				s++;
+	for (n = 0, i = beg; i < end; i++) {
+		if (set->matches[i].frecency == 0)
+			continue;
+		if (n == set->rankedsize) {
+			set->rankedsize = set->rankedsize ? set->rankedsize * 2 : 64;
+			if ((set->ranked = realloc(set->ranked, set->rankedsize * sizeof *set->ranked)) == NULL)
+				err(1, "realloc");
 		}
+		set->ranked[n].item = set->matches[i].item;
+		set->ranked[n].frecency = set->matches[i].frecency;
+		set->ranked[n++].pos = i;
 	}
-
-	return 0;
+	qsort(set->ranked, n, sizeof *set->ranked, ranksort);
+	for (i = 0; i < n; i++)
+		linkmatched(set, set->ranked[i].pos, len, first, last);
+	for (i = beg; i < end; i++)
+		if (set->matches[i].frecency == 0)
+			linkmatched(set, i, len, first, last);
 }
 
-/* free a item tree */
+/*
+ * Append the matches from the first one not linked up to the nth one, of
+ * the len bytes of text, to the list of matched items from *first to
+ * *last, and to the linked items.  The items chosen before are listed
+ * ahead of the other matches of their class linked with them: those of the
+ * pages generated so far, or all of them once the whole list is matched.
+ */
 static void
-cleanitem(struct Item *root)
+linkmatches(struct MatchSet *set, size_t n, size_t len, struct Item **first, struct Item **last)
 {
-	struct Item *item, *tmp;
-
-	item = root;
-	while (item != NULL) {
-		if (item->child != NULL)
-			cleanitem(item->child);
-		tmp = item;
-		item = item->next;
-		free(tmp->text);
-		free(tmp);
-	}
+	if (set->nlinked < set->nwordmatches)
+		linkrange(set, set->nlinked, MIN(n, set->nwordmatches), len, first, last);
+	if (n > set->nwordmatches)
+		linkrange(set, MAX(set->nlinked, set->nwordmatches), n, len, first, last);
+	set->nlinked = MAX(set->nlinked, n);
 }
 
 /* create list of matching items */
 static void
 getmatchlist(struct Prompt *prompt, struct Item *complist)
 {
-	struct Item *retitem = NULL;
-	struct Item *previtem = NULL;
-	struct Item *item = NULL;
-	size_t beg, len;
+	struct MatchSet *set;
+	struct Item *first = NULL;
+	size_t beg, len, want;
 	const char *text;
 
 	if (!prompt->cursor) {
@@ -1740,54 +4492,148 @@ getmatchlist(struct Prompt *prompt, struct Item *complist)
 		len = 0;
 	} else {
 		beg = prompt->cursor;
-		while (beg > 0 && !strchr(config.worddelimiters, prompt->text[--beg]))
+		while (beg > 0 && !isdelim(prompt->text[--beg]))
 			;
-		if (strchr(config.worddelimiters, prompt->text[beg]))
+		if (isdelim(prompt->text[beg]))
 			beg++;
 		len = prompt->cursor - beg;
 	}
 	text = prompt->text + beg;
 
-	/* build list of matched items using the .nextmatch and .prevmatch pointers */
-	for (item = complist; item; item = item->next) {
-		if (itemmatch(item, text, len, 0)) {
-			if (!retitem)
-				retitem = item;
-			item->prevmatch = previtem;
-			if (previtem)
-				previtem->nextmatch = item;
-			previtem = item;
-		}
+	text = normalizetext(prompt, text, &len);
+
+	/* get the items of the list chosen before, maybe by other instances since the list was last matched */
+	set = &prompt->matchset;
+	set->nused = 0;
+	if (!filecomp) {
+		refreshusage();
+		if (usefile.nrecords > 0)
+			getused(set, complist);
+	}
+
+	/* with no text, every item matches and they are all listed in order */
+	cancelled = 0;
+	if (Fflag && len > 0) {
+		set->complist = NULL;
+		fuzzymatchlist(prompt, complist, text, len);
+		prompt->stale = cancelled;
+		return;
 	}
-	/* now search for items that match in the middle of the item */
-	for (item = complist; item; item = item->next) {
-		if (!itemmatch(item, text, len, 0) && itemmatch(item, text, len, 1)) {
-			if (!retitem)
-				retitem = item;
-			item->prevmatch = previtem;
-			if (previtem)
-				previtem->nextmatch = item;
-			previtem = item;
+
+	/*
+	 * only the matches of the first pages of the dropdown list are
+	 * generated; the other ones are generated as the list is navigated
+	 */
+	want = filecomp ? SIZE_MAX : MATCHPAGES * prompt->maxitems;
+
+	/* the items matching an extension of the last text are among those matching it */
+	if (filecomp) {
+		set->complist = NULL;
+		matchitems(set, complist, text, len, want);
+	} else if (set->complist == complist && len >= set->len && memcmp(text, set->text, set->len) == 0) {
+		refinematches(set, text, len);
+		scanmatches(set, text, len, want);
+	} else {
+		matchitems(set, complist, text, len, want);
+		set->complist = complist;
+	}
+
+	/* if matching gave up, the list shown is left as that of an older text */
+	if (cancelled) {
+		set->complist = NULL;
+		prompt->stale = 1;
+		return;
+	}
+	prompt->stale = 0;
+	if (set->complist != NULL) {
+		if (set->textsize < len + 1) {
+			set->textsize = len + 1;
+			if ((set->text = realloc(set->text, set->textsize)) == NULL)
+				err(1, "realloc");
 		}
+		memcpy(set->text, text, len);
+		set->len = len;
+	}
+
+	/*
+	 * build list of matched items using the .nextmatch and .prevmatch
+	 * pointers; the items chosen before are listed first among those
+	 * matching at the beginning of a word, and among the other ones.
+	 * The matches in the middle are listed once all the items are matched.
+	 */
+	set->last = NULL;
+	set->nlinked = set->nlisted = 0;
+	linkmatches(set, (set->next != NULL) ? set->nwordmatches : set->nmatches, len, &first, &set->last);
+
+	prompt->firstmatch = first;
+	prompt->matchlist = first;
+	prompt->selitem = first;
+}
+
+/* generate the matches of the last text until want of them are linked, or until all of them are */
+static void
+extendmatchlist(struct Prompt *prompt, size_t want)
+{
+	struct MatchSet *set;
+	struct Item *first;
+
+	set = &prompt->matchset;
+	if (set->complist == NULL || set->next == NULL || set->nlinked >= want)
+		return;
+	scanmatches(set, set->text, set->len, want);
+	first = prompt->firstmatch;
+	linkmatches(set, (set->next != NULL) ? set->nwordmatches : set->nmatches, set->len, &first, &set->last);
+	if (prompt->firstmatch == NULL) {
+		prompt->firstmatch = first;
+		prompt->matchlist = first;
+		prompt->selitem = first;
 	}
-	if (previtem)
-		previtem->nextmatch = NULL;
+}
 
-	prompt->firstmatch = retitem;
-	prompt->matchlist = retitem;
-	prompt->selitem = retitem;
+/*
+ * Find the position, among the items linked into the list of matched
+ * items, of the first item listed.  Navigating moves it by a page at most,
+ * so it is looked for around where it was last found first.
+ */
+static size_t
+listedpos(struct Prompt *prompt)
+{
+	struct MatchSet *set;
+	size_t i, beg, end;
+
+	set = &prompt->matchset;
+	beg = (set->listpos > prompt->maxitems) ? set->listpos - prompt->maxitems : 0;
+	end = MIN(set->nlisted, set->listpos + prompt->maxitems + 1);
+	for (i = beg; i < end; i++)
+		if (set->linked[i].item == prompt->matchlist)
+			return set->listpos = i;
+	for (i = 0; i < set->nlisted; i++)
+		if (set->linked[i].item == prompt->matchlist)
+			return set->listpos = i;
+	return set->nlisted;
 }
 
 /* navigate through the list of matching items */
 static void
 navmatchlist(struct Prompt *prompt, int direction)
 {
+	struct MatchSet *set;
 	struct Item *item;
-	size_t i;
+	size_t i, k;
 
 	if (!prompt->selitem)
 		return;
 
+	/* generate the matches of the next pages, if they were not yet */
+	if (prompt->matchset.next != NULL) {
+		for (i = 0, item = prompt->matchlist;
+		     i < MATCHPAGES * prompt->maxitems && item;
+		     i++, item = item->nextmatch)
+			;
+		if (item == NULL)
+			extendmatchlist(prompt, prompt->matchset.nlinked + MATCHPAGES * prompt->maxitems);
+	}
+
 	if (direction > 0 && prompt->selitem->nextmatch) {
 		unsigned selnum;
 
@@ -1814,20 +4660,75 @@ navmatchlist(struct Prompt *prompt, int direction)
 		}
 	}
 
-	/* fill .itemarray */
+	/* fill .itemarray, with the spans of the items that matched, which were kept as they were linked */
+	set = &prompt->matchset;
+	k = listedpos(prompt);
 	for (i = 0, item = prompt->matchlist;
 	     i < prompt->maxitems && item;
-	     i++, item = item->nextmatch)
+	     i++, item = item->nextmatch) {
 		prompt->itemarray[i] = item;
+		if (k + i < set->nlisted && set->linked[k + i].item == item)
+			mapspan(item, set->linked[k + i].beg, set->linked[k + i].end - set->linked[k + i].beg, &prompt->spans[i]);
+		else
+			prompt->spans[i].beg = prompt->spans[i].end = 0;
+	}
 	prompt->nitems = i;
 }
 
+/* rematch the list of matching items after new items have been read */
+static void
+refreshmatchlist(struct Prompt *prompt, struct Item *rootitem)
+{
+	struct Item *matchlist, *selitem, *complist, *item;
+	size_t i;
+
+	if (filecomp || !prompt->matchlist)
+		return;
+	if ((complist = getcomplist(prompt, rootitem)) == NULL)
+		return;
+
+	/* keep the selection if we are still completing the same list */
+	matchlist = prompt->matchlist;
+	selitem = prompt->selitem;
+	getmatchlist(prompt, complist);
+	if (selitem && selitem->parent == complist->parent) {
+		/* the selected item may be among the matches not generated yet */
+		for (item = prompt->firstmatch; item && item != selitem; item = item->nextmatch)
+			;
+		if (item == NULL)
+			extendmatchlist(prompt, SIZE_MAX);
+		for (i = 0, item = matchlist;
+		     i < prompt->maxitems && item && item != selitem;
+		     i++, item = item->nextmatch)
+			;
+		prompt->matchlist = (item == selitem) ? matchlist : selitem;
+		prompt->selitem = selitem;
+	}
+	navmatchlist(prompt, 0);
+}
+
 /* zero variables for the list of matching items */
 static void
 delmatchlist(struct Prompt *prompt)
 {
 	prompt->matchlist = NULL;
 	prompt->nitems = 0;
+	prompt->stale = 0;
+}
+
+/* match the items again after the text was edited, giving up if a key is pressed meanwhile */
+static void
+rematchlist(struct Prompt *prompt, struct Item *complist)
+{
+	cancellable = 1;
+	getmatchlist(prompt, complist);
+	cancellable = 0;
+	if (prompt->stale)
+		return;
+	if (!prompt->matchlist)
+		delmatchlist(prompt);
+	else
+		navmatchlist(prompt, 0);
 }
 
 /* get Ctrl input operation */
@@ -1924,7 +4825,6 @@ keypress(struct Prompt *prompt, struct Item *rootitem, struct History *hist, XKe
 {
 	static struct Item *complist;   /* list of possible completions */
 	static char buf[INPUTSIZ];
-	static enum Ctrl prevoperation = CTRLNOTHING;
 	enum Ctrl operation;
 	char *s;
 	int len;
@@ -1946,11 +4846,23 @@ keypress(struct Prompt *prompt, struct Item *rootitem, struct History *hist, XKe
 	operation = getoperation(ksym, ev->state);
 	if (operation == INSERT && (iscntrl(*buf) || *buf == '\0'))
 		return Nop;
-	if (ISUNDO(operation) && ISEDITING(prevoperation))
+	if (ISUNDO(operation) && ISEDITING(prompt->prevoperation))
 		addundo(prompt, 0);
-	if (ISEDITING(operation) && operation != prevoperation)
+	if (ISEDITING(operation) && operation != prompt->prevoperation)
 		addundo(prompt, 1);
-	prevoperation = operation;
+	prompt->prevoperation = operation;
+
+	/* a list left as that of an older text is matched again before it is used */
+	if (prompt->stale && (operation == CTRLENTER || operation == CTRLPREV || operation == CTRLNEXT)) {
+		getmatchlist(prompt, complist);
+		if (!prompt->matchlist)
+			delmatchlist(prompt);
+		else
+			navmatchlist(prompt, 0);
+		if (operation != CTRLENTER)
+			return DrawPrompt;
+	}
+
 	switch (operation) {
 	case CTRLPASTE:
 		XConvertSelection(dpy, atoms[Clipboard], atoms[Utf8String], atoms[Utf8String], prompt->win, CurrentTime);
@@ -1963,7 +4875,7 @@ keypress(struct Prompt *prompt, struct Item *rootitem, struct History *hist, XKe
 			return Esc;
 		delmatchlist(prompt);
 		if (filecomp)
-			cleanitem(complist);
+			cleanarena(&filearena);
 		break;
 	case CTRLENTER:
 		if (prompt->matchlist)
@@ -2102,7 +5014,7 @@ insert:
 	}
 	if (ISEDITING(operation) || ISUNDO(operation)) {
 		if (prompt->matchlist && filecomp) {   /* if in a file completion, cancel it */
-			cleanitem(complist);
+			cleanarena(&filearena);
 			filecomp = 0;
 			delmatchlist(prompt);
 			return DrawPrompt;
@@ -2110,12 +5022,8 @@ insert:
 			complist = getcomplist(prompt, rootitem);
 			if (complist == NULL)
 				return DrawPrompt;
-			getmatchlist(prompt, complist);
-			if (!prompt->matchlist)
-				delmatchlist(prompt);
-			else
-				navmatchlist(prompt, 0);
-			return DrawPrompt;
+			rematchlist(prompt, complist);
+			return prompt->stale ? DrawInput : DrawPrompt;
 		} else {                        /* if not in completion just redraw input field */
 			return DrawInput;
 		}
@@ -2136,7 +5044,7 @@ getcurpos(struct Prompt *prompt, int x)
 	while (*s) {
 		if (x < w)
 			break;
-		(void)getnextutf8char(s, &next);
+		(void)getnextutf8char(s, NULL, &next);
 		len = strlen(prompt->text) - strlen(++s);
 		textwidth = drawtext(NULL, NULL, 0, 0, 0, prompt->text, len);
 		w = prompt->promptw + textwidth;
@@ -2253,16 +5161,15 @@ buttonmotion(struct Prompt *prompt, XMotionEvent *ev)
 static enum Press_ret
 pointermotion(struct Prompt *prompt, XMotionEvent *ev)
 {
-	static int intext = 0;
 	struct Item *prevhover;
 	int miny, maxy;
 
-	if (ev->y < prompt->h && !intext) {
+	if (ev->y < prompt->h && !prompt->intext) {
 		XDefineCursor(dpy, prompt->win, cursor);
-		intext = 1;
-	} else if (ev->y >= prompt->h && intext) {
+		prompt->intext = 1;
+	} else if (ev->y >= prompt->h && prompt->intext) {
 		XUndefineCursor(dpy, prompt->win);
-		intext = 0;
+		prompt->intext = 0;
 	}
 	if (ic.composing)       /* we ignore mouse events when composing */
 		return Nop;
@@ -2277,6 +5184,16 @@ pointermotion(struct Prompt *prompt, XMotionEvent *ev)
 	return (prevhover != prompt->hoveritem) ? DrawPrompt : Nop;
 }
 
+/* get time elapsed since ts, in miliseconds */
+static long
+elapsed(struct timespec *ts)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - ts->tv_sec) * 1000 + (now.tv_nsec - ts->tv_nsec) / 1000000;
+}
+
 /* save history in history file */
 static void
 savehist(struct Prompt *prompt, struct History *hist)
@@ -2308,14 +5225,61 @@ savehist(struct Prompt *prompt, struct History *hist)
 
 /* run event loop */
 static void
-run(struct Prompt *prompt, struct Item *rootitem, struct History *hist)
+run(struct Prompt *prompt, struct Item **rootitem, struct History *hist)
 {
+	struct pollfd pfd[2];
+	struct timespec lastrefresh = {0, 0};
+	struct Item *complist;
 	XEvent ev;
 	enum Press_ret retval = Nop;
+	int nfds, refresh = 0;
+	long wait;
+
+	/* poll the X connection, and, when reading items while running, the stdin */
+	pfd[0].fd = ConnectionNumber(dpy);
+	pfd[0].events = POLLIN;
+	pfd[1].fd = STDIN_FILENO;
+	pfd[1].events = POLLIN;
+	nfds = (rflag && config.itemfile == NULL) ? 2 : 1;
 
 	XMapRaised(dpy, prompt->win);
 	grabfocus(prompt->win);
-	while (!XNextEvent(dpy, &ev)) {
+	for (;;) {
+		if (!XPending(dpy)) {
+			/* once no key is waiting, match the text whose matching gave up */
+			if (prompt->stale) {
+				if ((complist = getcomplist(prompt, *rootitem)) != NULL)
+					rematchlist(prompt, complist);
+				else
+					prompt->stale = 0;
+				if (!prompt->stale)
+					drawprompt(prompt);
+				continue;
+			}
+
+			/* rematch items read since the last refresh, but not too often */
+			wait = -1;
+			if (refresh && (wait = REFRESHTIME - elapsed(&lastrefresh)) <= 0) {
+				if (prompt->matchlist) {
+					refreshmatchlist(prompt, *rootitem);
+					drawprompt(prompt);
+				}
+				clock_gettime(CLOCK_MONOTONIC, &lastrefresh);
+				refresh = 0;
+				wait = -1;
+			}
+			if (poll(pfd, nfds, wait) == -1 && errno != EINTR)
+				err(1, "poll");
+			if (nfds > 1 && pfd[1].revents) {
+				if (!readitems(pfd[1].fd, rootitem))
+					nfds = 1;
+				prompt->matchset.complist = NULL;       /* the lists may have grown */
+				prompt->context.nsteps = prompt->context.len = 0;
+				refresh = 1;
+			}
+			continue;
+		}
+		XNextEvent(dpy, &ev);
 		if (XFilterEvent(&ev, None))
 			continue;
 		retval = Nop;
@@ -2330,7 +5294,7 @@ run(struct Prompt *prompt, struct Item *rootitem, struct History *hist)
 				grabfocus(prompt->win);
 			break;
 		case KeyPress:
-			retval = keypress(prompt, rootitem, hist, &ev.xkey);
+			retval = keypress(prompt, *rootitem, hist, &ev.xkey);
 			break;
 		case ButtonPress:
 			retval = buttonpress(prompt, &ev.xbutton);
@@ -2373,7 +5337,6 @@ run(struct Prompt *prompt, struct Item *rootitem, struct History *hist)
 			break;
 		}
 	}
-	/* UNREACHABLE */
 }
 
 /* free history entries */
@@ -2409,6 +5372,20 @@ cleanprompt(struct Prompt *prompt)
 {
 	free(prompt->text);
 	free(prompt->itemarray);
+	free(prompt->scores);
+	free(prompt->spans);
+	free(prompt->matchset.text);
+	free(prompt->matchset.matches);
+	free(prompt->matchset.tmp);
+	free(prompt->matchset.used);
+	free(prompt->matchset.ranked);
+	free(prompt->matchset.linked);
+	cleantrigrams(&prompt->matchset);
+	cleanprefixes(prompt);
+	free(prompt->key);
+	free(prompt->ranks);
+	free(prompt->context.text);
+	free(prompt->context.steps);
 
 	XFreePixmap(dpy, prompt->pixmap);
 	XftDrawDestroy(prompt->draw);
@@ -2422,12 +5399,15 @@ cleandc(void)
 	XftColorFree(dpy, visual, colormap, &dc.hover[ColorBG]);
 	XftColorFree(dpy, visual, colormap, &dc.hover[ColorFG]);
 	XftColorFree(dpy, visual, colormap, &dc.hover[ColorCM]);
+	XftColorFree(dpy, visual, colormap, &dc.hover[ColorHL]);
 	XftColorFree(dpy, visual, colormap, &dc.normal[ColorBG]);
 	XftColorFree(dpy, visual, colormap, &dc.normal[ColorFG]);
 	XftColorFree(dpy, visual, colormap, &dc.normal[ColorCM]);
+	XftColorFree(dpy, visual, colormap, &dc.normal[ColorHL]);
 	XftColorFree(dpy, visual, colormap, &dc.selected[ColorBG]);
 	XftColorFree(dpy, visual, colormap, &dc.selected[ColorFG]);
 	XftColorFree(dpy, visual, colormap, &dc.selected[ColorCM]);
+	XftColorFree(dpy, visual, colormap, &dc.selected[ColorHL]);
 	XftColorFree(dpy, visual, colormap, &dc.separator);
 	XftColorFree(dpy, visual, colormap, &dc.border);
 	XFreeGC(dpy, dc.gc);
@@ -2438,6 +5418,12 @@ static void
 cleanic(void)
 {
 	XDestroyIC(ic.xic);
+}
+
+/* close input method */
+static void
+cleanim(void)
+{
 	XCloseIM(ic.xim);
 }
 
@@ -2448,46 +5434,253 @@ cleancursor(void)
 	XFreeCursor(dpy, cursor);
 }
 
-/* xprompt: a dmenu rip-off with contextual completion */
-int
-main(int argc, char *argv[])
+/* read len bytes from fd, return -1 on error or end of file */
+static int
+readall(int fd, void *buf, size_t len)
 {
-	struct History hist = {.entries = NULL, .index = 0, .size = 0};
-	struct Prompt prompt;
-	struct Item *rootitem;
+	ssize_t n;
+	char *p;
+
+	for (p = buf; len > 0; p += n, len -= n) {
+		if ((n = read(fd, p, len)) == -1 && errno == EINTR)
+			n = 0;
+		else if (n <= 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* write len bytes into fd, return -1 on error */
+static int
+writeall(int fd, const void *buf, size_t len)
+{
+	ssize_t n;
+	const char *p;
+
+	for (p = buf; len > 0; p += n, len -= n) {
+		if ((n = write(fd, p, len)) == -1 && errno == EINTR)
+			n = 0;
+		else if (n == -1)
+			return -1;
+	}
+	return 0;
+}
+
+/* get the address of the socket of the daemon for the display, return -1 if there is none */
+static int
+getsockaddr(struct sockaddr_un *addr)
+{
+	const char *dir, *display;
+	char *s;
+	int n;
+
+	if ((dir = getenv("XDG_RUNTIME_DIR")) == NULL || *dir == '\0')
+		return -1;
+	if ((display = getenv("DISPLAY")) == NULL || *display == '\0')
+		return -1;
+	memset(addr, 0, sizeof *addr);
+	addr->sun_family = AF_UNIX;
+	n = snprintf(addr->sun_path, sizeof addr->sun_path, "%s/" SOCKNAME, dir, display);
+	if (n < 0 || (size_t)n >= sizeof addr->sun_path)
+		return -1;
+
+	/* the display name may contain slashes */
+	for (s = addr->sun_path + strlen(dir) + 1; *s != '\0'; s++)
+		if (*s == '/')
+			*s = '_';
+	return 0;
+}
+
+/* connect to the socket of the daemon, return -1 if there is no daemon */
+static int
+connectdaemon(struct sockaddr_un *addr)
+{
+	int sock;
+
+	if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		return -1;
+	if (connect(sock, (struct sockaddr *)addr, sizeof *addr) == -1) {
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+/* let the daemon prompt in our place; return -1 if there is no daemon, or the exit status otherwise */
+static int
+client(int argc, char *argv[])
+{
+	struct sockaddr_un addr;
+	struct Request req;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(REQUESTFDS * sizeof (int))];
+	} control;
+	int fds[REQUESTFDS];
+	unsigned char status;
 	Window parentwin;
+	void (*sigpipe)(int);
+	char *buf, *p;
+	size_t len, n;
+	ssize_t sent;
+	int sock, i, envc;
+
+	if (getsockaddr(&addr) == -1 || (sock = connectdaemon(&addr)) == -1)
+		return -1;
+
+	/* check the options here, so a mistake does not make the daemon exit */
+	getoptions(argc, argv, &parentwin);
+	optind = 1;
+
+	/* the request is followed by the arguments and the environment */
+	len = 0;
+	for (i = 0; i < argc; i++)
+		len += strlen(argv[i]) + 1;
+	for (envc = 0; environ[envc] != NULL; envc++)
+		len += strlen(environ[envc]) + 1;
+	if (len > REQUESTSIZ || (fds[3] = open(".", O_RDONLY)) == -1) {
+		close(sock);
+		return -1;
+	}
+	req.argc = argc;
+	req.envc = envc;
+	req.size = len;
+	buf = emalloc(sizeof req + len);
+	memcpy(buf, &req, sizeof req);
+	p = buf + sizeof req;
+	for (i = 0; i < argc; p += n, i++)
+		memcpy(p, argv[i], n = strlen(argv[i]) + 1);
+	for (i = 0; i < envc; p += n, i++)
+		memcpy(p, environ[i], n = strlen(environ[i]) + 1);
+
+	/* the daemon reads from and writes to our own stdin, stdout and stderr */
+	fds[0] = STDIN_FILENO;
+	fds[1] = STDOUT_FILENO;
+	fds[2] = STDERR_FILENO;
+	memset(&msg, 0, sizeof msg);
+	memset(&control, 0, sizeof control);
+	iov.iov_base = buf;
+	iov.iov_len = sizeof req + len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof control.buf;
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof fds);
+	memcpy(CMSG_DATA(cmsg), fds, sizeof fds);
+	sigpipe = signal(SIGPIPE, SIG_IGN);
+	if ((sent = sendmsg(sock, &msg, 0)) == -1) {
+		/* the daemon got nothing, so we can still prompt by ourselves */
+		signal(SIGPIPE, sigpipe);
+		close(fds[3]);
+		close(sock);
+		free(buf);
+		return -1;
+	}
+	close(fds[3]);
+	if (writeall(sock, buf + sent, sizeof req + len - sent) == -1 ||
+	    readall(sock, &status, 1) == -1)
+		status = 1;
+	close(sock);
+	free(buf);
+	return status;
+}
 
-	/* set locale and modifiers */
-	if (!setlocale(LC_CTYPE, "") || !XSupportsLocale())
-		warnx("warning: no locale support");
-	if (!XSetLocaleModifiers(""))
-		warnx("warning: could not set locale modifiers");
+/* receive the request of a client, return -1 if it is invalid */
+static int
+recvrequest(int sock, char **buf_ret, char ***argv_ret, int *argc_ret, char ***env_ret, int fds[])
+{
+	struct Request req;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(REQUESTFDS * sizeof (int))];
+	} control;
+	char *buf, **args, *s;
+	size_t i, nfds;
+	ssize_t n;
 
-	/* open connection to server and set X variables */
-	if ((dpy = XOpenDisplay(NULL)) == NULL)
-		errx(1, "cannot open display");
-	screen = DefaultScreen(dpy);
-	visual = DefaultVisual(dpy, screen);
-	root = RootWindow(dpy, screen);
-	colormap = DefaultColormap(dpy, screen);
+	memset(&msg, 0, sizeof msg);
+	iov.iov_base = &req;
+	iov.iov_len = sizeof req;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof control.buf;
+	while ((n = recvmsg(sock, &msg, 0)) == -1 && errno == EINTR)
+		;
+	if (n <= 0)
+		return -1;
 
-	/* initialize resource manager database */
-	XrmInitialize();
-	if ((xrm = XResourceManagerString(dpy)) != NULL)
-		xdb = XrmGetStringDatabase(xrm);
+	/* get the file descriptors of the client */
+	nfds = 0;
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof (int);
+		memcpy(fds, CMSG_DATA(cmsg), MIN(nfds, REQUESTFDS) * sizeof (int));
+	}
+	if (nfds != REQUESTFDS || (msg.msg_flags & MSG_CTRUNC)) {
+		for (i = 0; i < MIN(nfds, REQUESTFDS); i++)
+			close(fds[i]);
+		return -1;
+	}
+
+	/* get the arguments and the environment, each one must be NUL-terminated */
+	buf = NULL;
+	args = NULL;
+	if (readall(sock, (char *)&req + n, sizeof req - n) == -1 ||
+	    req.argc == 0 || req.size == 0 || req.size > REQUESTSIZ)
+		goto error;
+	buf = emalloc(req.size);
+	if (readall(sock, buf, req.size) == -1 || buf[req.size - 1] != '\0')
+		goto error;
+	args = ecalloc((size_t)req.argc + req.envc + 2, sizeof *args);
+	for (s = buf, i = 0; i < (size_t)req.argc + req.envc; i++) {
+		if (s == buf + req.size)
+			goto error;
+		args[i < req.argc ? i : i + 1] = s;
+		s += strlen(s) + 1;
+	}
+	*buf_ret = buf;
+	*argv_ret = args;
+	*argc_ret = req.argc;
+	*env_ret = args + req.argc + 1;
+	return 0;
+
+error:
+	for (i = 0; i < REQUESTFDS; i++)
+		close(fds[i]);
+	free(args);
+	free(buf);
+	return -1;
+}
+
+/* prompt for the user, in the working directory and with the options and environment of a client */
+static void
+session(int argc, char *argv[])
+{
+	struct History hist = {.entries = NULL, .index = 0, .size = 0};
+	struct Prompt prompt;
+	struct Item *rootitem;
+	Window parentwin;
 
 	/* get configuration */
 	parentwin = root;
-	getresources();
 	getenvironment();
+	initdelimiters();
 	prompt.promptstr = getoptions(argc, argv, &parentwin);
 
 	/* init */
-	initatoms();
 	initmonitor();
 	initctrl();
-	initdc();
-	initcursor();
 
 	/* setup prompt */
 	setpromptinput(&prompt);
@@ -2499,8 +5692,13 @@ main(int argc, char *argv[])
 	setpromptic(&prompt);
 	setpromptevents(&prompt, parentwin);
 
-	/* initiate item list */
-	rootitem = parsestdin(stdin);
+	/* initiate item list, unless items are read from stdin while running */
+	if (config.itemfile != NULL)
+		rootitem = parsefile(config.itemfile);
+	else if (!rflag)
+		rootitem = parsestdin(1);
+	else
+		rootitem = NULL;
 
 	/* open config.histfile and load history */
 	if (config.histfile != NULL && *config.histfile != '\0') {
@@ -2513,22 +5711,230 @@ main(int argc, char *argv[])
 		}
 	}
 
+	/* open config.usagefile, whose records are read as the items are matched */
+	if (config.usagefile != NULL && *config.usagefile != '\0')
+		openusage(config.usagefile);
+
 	/* grab input */
 	if (!wflag)
 		grabkeyboard();
 
 	/* run event loop; and, if run return nonzero, save the history */
-	run(&prompt, rootitem, &hist);
+	run(&prompt, &rootitem, &hist);
 
 	/* freeing stuff */
 	if (hflag)
 		fclose(hist.fp);
-	cleanitem(rootitem);
+	closeusage();
+	cleanread();
+	cleanarena(&itemarena);
+	cleanarena(&filearena);
+	if (itemmap != NULL)
+		munmap(itemmap, itemmapsize);
+	itemmap = NULL;
+	free(itembuf);
+	itembuf = NULL;
 	cleanhist(&hist);
 	cleanundo(prompt.undo);
 	cleanprompt(&prompt);
-	cleandc();
 	cleanic();
+}
+
+/*
+ * Listen on the socket of the daemon, and fork a worker to prompt for the
+ * clients.  A session that fails exits the worker, as xprompt exits on
+ * errors, so the worker is forked again for the next clients, unless it
+ * could not even start or was killed.  Return the socket in the worker, and the pipe
+ * on which it tells that it started.
+ */
+static int
+spawnworker(int *ready_ret)
+{
+	struct sockaddr_un addr;
+	pid_t pid;
+	char c;
+	int sock, fd, started, status;
+	int ready[2];
+
+	if (getsockaddr(&addr) == -1)
+		errx(1, "cannot run as a daemon without XDG_RUNTIME_DIR and DISPLAY");
+	if ((fd = connectdaemon(&addr)) != -1)
+		errx(1, "%s: daemon already running", addr.sun_path);
+	unlink(addr.sun_path);
+	if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		err(1, "socket");
+	if (bind(sock, (struct sockaddr *)&addr, sizeof addr) == -1)
+		err(1, "%s", addr.sun_path);
+	if (listen(sock, SOMAXCONN) == -1)
+		err(1, "listen");
+
+	for (;;) {
+		if (pipe(ready) == -1)
+			err(1, "pipe");
+		if ((pid = fork()) == -1)
+			err(1, "fork");
+		if (pid == 0) {
+			close(ready[0]);
+			*ready_ret = ready[1];
+			return sock;
+		}
+		close(ready[1]);
+		started = (readall(ready[0], &c, 1) == 0);
+		close(ready[0]);
+		while (waitpid(pid, &status, 0) == -1)
+			if (errno != EINTR)
+				err(1, "waitpid");
+		if (!started) {
+			unlink(addr.sun_path);
+			exit(WIFEXITED(status) ? WEXITSTATUS(status) : 1);
+		}
+
+		/* a worker killed by the user takes the daemon with it */
+		if (WIFSIGNALED(status) && (WTERMSIG(status) == SIGTERM || WTERMSIG(status) == SIGINT ||
+		    WTERMSIG(status) == SIGHUP || WTERMSIG(status) == SIGKILL)) {
+			unlink(addr.sun_path);
+			exit(1);
+		}
+	}
+}
+
+/* run as the worker of the daemon, prompting for a client at a time */
+static void
+serve(int sock, int ready)
+{
+	struct Config defconfig;
+	char **defenv, **argv, **env, *buf;
+	int saved[REQUESTFDS], fds[REQUESTFDS];
+	unsigned char status;
+	int fd, argc, i;
+
+	/* save what is replaced by the ones of each client */
+	for (i = 0; i < REQUESTFDS - 1; i++)
+		if ((saved[i] = dup(i)) == -1)
+			err(1, "dup");
+	if ((saved[i] = open(".", O_RDONLY)) == -1)
+		err(1, ".");
+	defconfig = config;
+	defenv = environ;
+	signal(SIGPIPE, SIG_IGN);
+
+	/* the worker is ready for clients, so it is forked again if a session fails */
+	status = 0;
+	writeall(ready, &status, 1);
+	close(ready);
+
+	for (;;) {
+		if ((fd = accept(sock, NULL, NULL)) == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			err(1, "accept");
+		}
+		if (recvrequest(fd, &buf, &argv, &argc, &env, fds) == -1) {
+			close(fd);
+			continue;
+		}
+
+		/* run the session as if the client were prompting by itself */
+		for (i = 0; i < REQUESTFDS - 1; i++)
+			dup2(fds[i], i);
+		if (fchdir(fds[i]) == -1)
+			warn("fchdir");
+		environ = env;
+		config = defconfig;
+		aflag = cflag = dflag = Fflag = fflag = hflag = mflag = pflag = rflag = sflag = wflag = 0;
+		fstrncmp = strncmp;
+		filecomp = 0;
+		optind = 1;
+		clearerr(stdout);
+		session(argc, argv);
+		fflush(stdout);
+		XUngrabKeyboard(dpy, CurrentTime);
+		XSync(dpy, True);
+
+		/* the client exits once its stdout and stderr are not used anymore */
+		environ = defenv;
+		for (i = 0; i < REQUESTFDS - 1; i++)
+			dup2(saved[i], i);
+		fchdir(saved[i]);
+		for (i = 0; i < REQUESTFDS; i++)
+			close(fds[i]);
+		status = 0;
+		writeall(fd, &status, 1);
+		close(fd);
+		free(argv);
+		free(buf);
+	}
+}
+
+/* xprompt: a dmenu rip-off with contextual completion */
+int
+main(int argc, char *argv[])
+{
+	char *progname;
+	int status;
+	int sock = -1;
+	int ready = -1;
+
+	/* when called as xprompt-compile, compile the items in stdin rather than prompt */
+	progname = (progname = strrchr(argv[0], '/')) != NULL ? progname + 1 : argv[0];
+	if (strcmp(progname, COMPILENAME) == 0) {
+		if (argc > 1)
+			compileusage();
+		initdelimiters();
+		if (writeimage(stdout, parsestdin(0)) == -1)
+			err(1, "could not write image");
+		cleanarena(&itemarena);
+		free(itembuf);
+		return 0;
+	}
+
+	/* when a daemon is running, let it prompt in our place */
+	if (argc > 1 && strcmp(argv[1], "-D") == 0) {
+		if (argc > 2)
+			usage();
+		Dflag = 1;
+		sock = spawnworker(&ready);
+	} else if ((status = client(argc, argv)) != -1) {
+		return status;
+	}
+
+	/* set locale and modifiers */
+	if (!setlocale(LC_CTYPE, "") || !XSupportsLocale())
+		warnx("warning: no locale support");
+	if (!XSetLocaleModifiers(""))
+		warnx("warning: could not set locale modifiers");
+
+	/* open connection to server and set X variables */
+	if ((dpy = XOpenDisplay(NULL)) == NULL)
+		errx(1, "cannot open display");
+	screen = DefaultScreen(dpy);
+	visual = DefaultVisual(dpy, screen);
+	root = RootWindow(dpy, screen);
+	colormap = DefaultColormap(dpy, screen);
+
+	/* initialize resource manager database */
+	XrmInitialize();
+	if ((xrm = XResourceManagerString(dpy)) != NULL)
+		xdb = XrmGetStringDatabase(xrm);
+
+	/* get configuration */
+	getresources();
+
+	/* init */
+	initatoms();
+	initdc();
+	initim();
+	initcursor();
+
+	/* prompt, or keep prompting for the clients of the daemon */
+	if (Dflag)
+		serve(sock, ready);
+	else
+		session(argc, argv);
+
+	/* freeing stuff */
+	cleandc();
+	cleanim();
 	cleancursor();
 	XrmDestroyDatabase(xdb);
 	XCloseDisplay(dpy);
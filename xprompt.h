@@ -1,8 +1,43 @@
 #define CLASSNAME    "XPrompt"
 #define PROGNAME     "xprompt"
+#define COMPILENAME  "xprompt-compile"
+#define IMAGEMAGIC   "XPROMPT"
+#define IMAGEVERSION 1
+#define IMAGEORDER   0x01020304
+#define CACHEDIR     "xprompt"
+#define USAGEMAGIC   "XPUSAGE"
+#define USAGEVERSION 2
+#define USAGEBUCKETS 1024   /* initial number of buckets of the usage file, a power of two */
+#define USAGELOAD    2      /* maximum number of records per bucket, before the buckets are doubled */
+#define DAYSECS      (24 * 60 * 60)
+#define SOCKNAME     "xprompt-%s"   /* name of the daemon socket, for each display */
+#define HASHSEED     0xcbf29ce484222325
+#define HASHMUL      0x9e3779b97f4a7c15
 #define INPUTSIZ     1024
 #define DEFHEIGHT    20     /* default height for each text line */
 #define DOUBLECLICK  250    /* time in miliseconds of a double click */
+#define FUZZYMATCH   16     /* score of each character matched by fuzzy matching */
+#define FUZZYWORD    8      /* bonus for a character matched at the beginning of a word */
+#define FUZZYRUN     4      /* bonus for a character matched right after another one */
+#define FUZZYGAP     1      /* penalty for each character skipped between matches */
+#define READSIZ      65536  /* minimum size of each read of items */
+#define PARSESIZ     1048576 /* minimum size of a file parsed by each thread */
+#define MAXTHREADS   64     /* maximum number of threads */
+#define MATCHSIZ     50000  /* minimum number of items matched by each thread */
+#define MATCHPAGES   2      /* number of pages of the dropdown list whose matches are generated ahead */
+#define CANCELSIZ    4096   /* number of items matched between checks for a key press */
+#define TRIGRAMSIZ   100000 /* minimum number of items of a list to be indexed by trigrams */
+#define TRIGRAMBITS  18
+#define TRIGRAMBUCKETS (1 << TRIGRAMBITS) /* number of buckets of trigrams in an index */
+#define PREFIXSIZ    256    /* minimum number of items of a list to be indexed by their strings */
+#define PREFIXBLOCK  32     /* number of sorted items whose first item in the list is scanned for */
+#define CACHESIZ     1048576 /* minimum size of items in stdin to be cached */
+#define CACHEMAX     268435456 /* maximum size of the cache, beyond which the least recently used images are removed */
+#define REQUESTSIZ   1048576 /* maximum size of the arguments and environment of a client */
+#define REQUESTFDS   4      /* stdin, stdout, stderr and working directory of a client */
+#define ARENASIZ     65536  /* minimum size of each chunk of an arena */
+#define INTERNSIZ    1024   /* initial size of a table of interned strings */
+#define REFRESHTIME  100    /* time in miliseconds between rematches of items being read */
 #define TEXTPART     7      /* completion word can be 1/7 of xprompt width */
 #define MINTEXTWIDTH 200    /* minimum width of the completion word */
 #define NLETTERS     'z' - 'a' + 1
@@ -12,6 +47,7 @@
 #define MAX(x,y) ((x)>(y)?(x):(y))
 #define MIN(x,y) ((x)<(y)?(x):(y))
 #define BETWEEN(x, a, b)    ((a) <= (x) && (x) <= (b))
+#define FOLD(c, fold) ((fold) ? tolower((unsigned char)(c)) : (unsigned char)(c))
 #define ISSOUTH(x) ((x) == SouthGravity || (x) == SouthWestGravity || (x) == SouthEastGravity)
 #define ISMOTION(x) ((x) == CTRLBOL || (x) == CTRLEOL || (x) == CTRLLEFT \
                     || (x) == CTRLRIGHT || (x) == CTRLWLEFT || (x) == CTRLWRIGHT)
@@ -21,9 +57,10 @@
                      || (x) == CTRLDELRIGHT || (x) == CTRLDELWORD || (x) == INSERT)
 #define ISUNDO(x) ((x) == CTRLUNDO || (x) == CTRLREDO)
 
-enum {ColorFG, ColorBG, ColorCM, ColorLast};
+enum {ColorFG, ColorBG, ColorCM, ColorHL, ColorLast};
 enum {LowerCase, UpperCase, CaseLast};
 enum Press_ret {DrawPrompt, DrawInput, Esc, Enter, Nop};
+enum {NoMatch, WordMatch, MiddleMatch};
 
 /* atoms */
 enum {
@@ -77,12 +114,15 @@ struct Config {
 	const char *background_color;
 	const char *foreground_color;
 	const char *description_color;
+	const char *match_color;
 	const char *hoverbackground_color;
 	const char *hoverforeground_color;
 	const char *hoverdescription_color;
+	const char *hovermatch_color;
 	const char *selbackground_color;
 	const char *selforeground_color;
 	const char *seldescription_color;
+	const char *selmatch_color;
 	const char *separator_color;
 	const char *border_color;
 
@@ -97,14 +137,21 @@ struct Config {
 	const char *histfile;
 	size_t histsize;
 
+	const char *usagefile;
+
+	const char *itemfile;
+
 	int indent;
+
+	int camelcase;
+	int stripaccents;
 };
 
 /* draw context structure */
 struct DC {
-	XftColor hover[ColorLast];      /* bg and fg of hovered item */
-	XftColor normal[ColorLast];     /* bg and fg of normal text */
-	XftColor selected[ColorLast];   /* bg and fg of the selected item */
+	XftColor hover[ColorLast];      /* bg, fg, description and match of hovered item */
+	XftColor normal[ColorLast];     /* bg, fg, description and match of normal text */
+	XftColor selected[ColorLast];   /* bg, fg, description and match of the selected item */
 	XftColor border;                /* color of the border */
 	XftColor separator;             /* color of the separator */
 
@@ -125,16 +172,287 @@ struct IC {
 	int caret;
 	long eventmask;
 	int composing;              /* whether user is composing text */
+	XICCallback destroy;        /* callback for when the input method or context is destroyed */
+};
+
+/* chunk of memory allocated from an arena */
+struct Chunk {
+	struct Chunk *next;     /* previously allocated chunk */
+	size_t size;            /* size of the data */
+	size_t used;            /* how many bytes of data are in use */
+	char data[];
+};
+
+/* arena, from which memory is allocated in chunks and freed at once */
+struct Arena {
+	struct Chunk *chunk;    /* last allocated chunk */
+};
+
+/* interned string */
+struct String {
+	char *s;
+	size_t len;
+	uint64_t hash;
+	size_t off;             /* offset of the string into the strings of an image */
+};
+
+/* hash table of interned strings, so equal strings are stored once */
+struct Intern {
+	struct String *strings;
+	size_t size;            /* a power of two */
+	size_t nstrings;
 };
 
 /* completion items */
 struct Item {
-	struct Item *prevmatch, *nextmatch; /* previous and next items */
-	struct Item *prev, *next;           /* previous and next matched items */
-	struct Item *parent;                /* parent item */
-	struct Item *child;                 /* point to the list of child items */
+	/* fields read when scanning a list of items come first, within a cache line */
 	char *text;                         /* content of the completion item */
+	char *key;                          /* normalized matched string, with -i; or NULL */
+	uint32_t *words;                    /* offsets where the words of the matched string (or key) begin */
+	struct Item *next;                  /* next item */
+	uint32_t textlen;                   /* length of the content */
+	uint32_t keylen;                    /* length of the key */
+	uint32_t nwords;                    /* number of words, or 0 if they are not known */
+	uint32_t desclen;                   /* length of the description, matched instead with -d */
+
+	struct Item *child;                 /* point to the list of child items */
+	struct Item *prevmatch, *nextmatch; /* previous and next matched items */
+	struct Item *prev;                  /* previous item */
+	struct Item *parent;                /* parent item */
 	char *description;                  /* description of the completion item */
+	uint32_t *keymap;                   /* offset in the matched string of each byte of the key, or NULL */
+};
+
+/* part of the listed string of an item that matches the text, highlighted on the dropdown list */
+struct Span {
+	size_t beg, end;
+};
+
+/* item (matching the text, or in a list sorted by strings), and where it is in its list */
+struct Match {
+	struct Item *item;
+	size_t pos;
+	unsigned frecency;      /* how frecently a matching item was chosen, zero if it never was */
+	uint32_t off;           /* where the text matches the matched string of a matching item */
+};
+
+/* item linked into the list of matched items, and the part of its matched string that matches the text */
+struct Linked {
+	struct Item *item;
+	uint32_t beg, end;
+};
+
+/* chunk of a list of items matched by a thread */
+struct Classify {
+	struct Item *beg;               /* first item of the chunk */
+	size_t nitems;                  /* number of items in the chunk */
+	const char *text;               /* text to be matched */
+	size_t len;
+	unsigned char *classes;         /* how each item matches text */
+	uint32_t *offsets;              /* where text matches each item that matches it */
+};
+
+/* threads kept to classify the chunks of long lists of items */
+struct Pool {
+	int started;                    /* whether the threads were started */
+	pthread_t *threads;
+	size_t nthreads;                /* number of threads, besides the one matching the list */
+	pthread_mutex_t mutex;
+	pthread_cond_t work;            /* signaled when chunks are posted */
+	pthread_cond_t done;            /* signaled when the last chunk posted is classified */
+
+	struct Classify *chunks;        /* chunks posted, one for each thread at most */
+	size_t maxchunks;
+	size_t nchunks;                 /* number of chunks posted */
+	size_t next;                    /* next chunk to be taken by a thread */
+	size_t pending;                 /* number of chunks not classified yet */
+	unsigned char *classes;         /* how each item of the chunks posted matches the text */
+	uint32_t *offsets;              /* where the text matches each of them */
+};
+
+/* index of the items of a list by the trigrams in their strings */
+struct Trigrams {
+	struct Trigrams *next;          /* index of another list */
+	struct Item *complist;          /* list of items indexed */
+	struct Item **items;            /* items of the list, by their position */
+	size_t nitems;
+	size_t *offsets;                /* where the postings of each bucket begin, and of the next one */
+	uint32_t *postings;             /* positions of the items with a trigram of each bucket */
+};
+
+/* index of the items of a list by their strings, to look up the first item beginning with a word */
+struct Prefixes {
+	struct Prefixes *next;          /* index of another list */
+	struct Item *list;              /* first item of the list indexed */
+	size_t nitems;
+	struct Match *sorted;           /* items of the list sorted by their strings */
+	size_t nblocks;                 /* number of blocks of PREFIXBLOCK sorted items */
+	uint32_t **firsts;              /* for each k, the sorted item first in the list of each range of 2^k blocks */
+	size_t nlevels;                 /* number of ranges of sizes that are powers of 2 */
+};
+
+/* list of items completed after a word of the text */
+struct Step {
+	size_t end;             /* where the word ends in the text */
+	struct Item *list;      /* list of items completed after the word */
+	size_t nword;           /* number of words up to it */
+	int found;              /* whether any word up to it was found */
+};
+
+/* lists of items completed after the words of the text, as the text was when they were looked up */
+struct Context {
+	char *text;             /* text up to the delimiter after the last word */
+	size_t len, textsize;
+	struct Step *steps;
+	size_t nsteps, maxsteps;
+};
+
+/* items matching the last text, refined rather than matched again when the text is extended */
+struct MatchSet {
+	struct Item *complist;  /* list of items that was matched, or NULL if there is none */
+	char *text;             /* text the items were matched against */
+	size_t len, textsize;
+
+	struct Match *matches;  /* matches at the beginning of a word, then matches in the middle */
+	struct Match *tmp;      /* where the matches are refined into */
+	size_t nmatches;        /* number of matches */
+	size_t nwordmatches;    /* number of matches at the beginning of a word */
+	size_t size;            /* size of the arrays of matches */
+
+	struct Item *next;      /* first item not matched yet, or NULL if all items were */
+	size_t pos;             /* position of that item in the list */
+	size_t nlinked;         /* number of matches linked into the list of matched items */
+	struct Item *last;      /* last item linked into the list of matched items */
+	struct Linked *linked;  /* items linked into the list of matched items, in order */
+	size_t nlisted;         /* number of them */
+	size_t linkedsize;
+	size_t listpos;         /* position among them of the first item listed, when it was last looked up */
+
+	uint64_t parenthash;    /* hash of the path of the parent of the list matched */
+	struct Used *used;      /* items of that list chosen before, by their hashes */
+	size_t nused, usedsize;
+	struct Rank *ranked;    /* matches chosen before being linked, by decreasing frecency */
+	size_t rankedsize;
+
+	struct Trigrams *trigrams;      /* indices of the long lists that were matched */
+};
+
+/* item to be linked to the tree after the chunk it was parsed in */
+struct Stitch {
+	struct Item *item;      /* item to be linked */
+	struct Item *anchor;    /* item of the same chunk continued by item or by its parents */
+	unsigned steps;         /* how many levels item is above anchor */
+};
+
+/* chunk of a file of items to be parsed by a thread */
+struct Parse {
+	pthread_t thread;
+	int threaded;                   /* whether thread was created */
+
+	char *beg, *end;                /* lines to be parsed */
+	struct Arena arena;             /* where items are allocated */
+	struct Arena words;             /* where word offsets are allocated, kept after parsing */
+
+	struct Item *first, *last;      /* first and last items of the chunk */
+	unsigned firstlevel, lastlevel; /* indentation levels of first and last items */
+
+	struct Stitch *stitches;        /* items whose parents are not in the chunk */
+	size_t nstitches, maxstitches;
+};
+
+/* header of a compiled image of items, followed by the items and the strings */
+struct ImageHeader {
+	char magic[8];          /* IMAGEMAGIC */
+	uint32_t version;       /* IMAGEVERSION */
+	uint32_t byteorder;     /* IMAGEORDER, in the byte order of the image */
+	uint32_t nitems;        /* number of items */
+	uint32_t nroots;        /* number of items at the top of the tree */
+	uint64_t strsize;       /* size of the strings */
+};
+
+/* item in a compiled image, siblings are contiguous */
+struct ImageItem {
+	uint32_t text;          /* offset of the text into the strings */
+	uint32_t textlen;       /* length of the text */
+	uint32_t description;   /* offset of the description into the strings */
+	uint32_t desclen;       /* length of the description, zero if none */
+	uint32_t child;         /* index of the first child item */
+	uint32_t nchildren;     /* number of child items */
+};
+
+/* header of a usage file, followed by the buckets and the records */
+struct UsageHeader {
+	char magic[8];          /* USAGEMAGIC */
+	uint32_t version;       /* USAGEVERSION */
+	uint32_t byteorder;     /* IMAGEORDER, in the byte order of the file */
+	uint32_t nbuckets;      /* number of buckets, a power of two */
+	uint32_t pad;
+};
+
+/* how often and how recently an item was chosen, appended to the usage file the first time it is */
+struct UsageRecord {
+	uint64_t hash;          /* hash of the path of the item in the tree */
+	uint64_t parent;        /* hash of the path of its parent, whose list it is in */
+	uint32_t next;          /* index plus one of the next record in the same bucket, zero if none */
+	uint32_t count;         /* how many times the item was chosen */
+	int64_t time;           /* when the item was last chosen */
+};
+
+/* usage file mapped into memory; records are looked up as the items are matched, not read at once */
+struct Usage {
+	const char *path;
+	int fd;                         /* usage file, or -1 if there is none */
+	char *map;
+	size_t mapsize;
+	uint32_t *buckets;              /* index plus one of the last record of each bucket, zero if none */
+	uint32_t nbuckets;
+	struct UsageRecord *records;
+	size_t nrecords;                /* number of records mapped */
+	time_t now;
+};
+
+/* matched item ranked by how frecently it was chosen */
+struct Rank {
+	struct Item *item;
+	unsigned frecency;
+	size_t pos;                     /* position of the item among the matches */
+	uint32_t beg, end;              /* part of its matched string that matches the text, when fuzzy matching */
+};
+
+/* item chosen before, of the list being matched, looked up by the hash of its path as the items match */
+struct Used {
+	uint64_t hash;
+	unsigned frecency;
+};
+
+/* image in the cache directory, when it is pruned */
+struct CacheEntry {
+	char name[64];
+	time_t mtime;           /* when the image was last used */
+	size_t size;
+};
+
+/* request of a client to the daemon, followed by its arguments and environment */
+struct Request {
+	uint32_t argc;          /* number of arguments, including the program name */
+	uint32_t envc;          /* number of environment variables */
+	uint32_t size;          /* size of the arguments and variables, each NUL-terminated */
+};
+
+/* items read from stdin kept by the daemon between sessions, with the memory they are in */
+struct Keep {
+	struct Item *rootitem;
+	struct Arena arena;     /* arena the items are allocated from */
+	char *input;            /* items read from stdin, in buf or after the image in map */
+	char *buf;              /* items read from stdin, when they were parsed */
+	char *map;              /* cached image of the items, when it was loaded */
+	size_t mapsize;
+	uint64_t hash;          /* hash of the items read from stdin */
+	size_t len;             /* length of the items read from stdin */
+	int dflag;              /* whether the words of the items are those of their descriptions */
+	int fold;               /* whether the items have keys */
+	int stripaccents;       /* whether the diacritics were removed from the keys */
+	char *worddelimiters;   /* delimiters the words of the items were split with */
 };
 
 /* monitor geometry structure */
@@ -162,14 +480,26 @@ struct Prompt {
 
 	struct Undo *undo;          /* undo list */
 	struct Undo *undocurr;      /* current undo entry */
+	enum Ctrl prevoperation;    /* last operation, editing operations are undone together */
 
 	struct Item *firstmatch;    /* first item that matches input */
 	struct Item *matchlist;     /* first item that matches input to be listed */
 	struct Item *selitem;       /* selected item */
 	struct Item *hoveritem;     /* hovered item */
 	struct Item **itemarray;    /* array containing nitems matching text */
+	int *scores;                /* scores of the items in itemarray, when fuzzy matching */
+	struct Span *spans;         /* spans of the items in itemarray that match the text */
+	struct MatchSet matchset;   /* items matching the last text */
+	struct Prefixes *prefixes;  /* indices of the long lists that were descended into */
+	struct Context context;     /* lists completed after the words of the text */
+	char *key;                  /* text being completed, normalized, with -i */
+	size_t keysize;
+	struct Rank *ranks;         /* matches chosen before, or frecencies of the items in itemarray */
+	size_t ranksize;
 	size_t nitems;              /* number of items in itemarray */
 	size_t maxitems;            /* maximum number of items in itemarray */
+	size_t nitemswin;           /* number of items the window is sized for */
+	int stale;                  /* whether the list is that of an older text, as matching gave up */
 
 	int gravity;                /* where in the screen to map xprompt */
 	int x, y;                   /* position of xprompt */
@@ -183,6 +513,7 @@ struct Prompt {
 	Drawable pixmap;            /* where to draw shapes on */
 	XftDraw *draw;              /* where to draw text on */
 	Window win;                 /* xprompt window */
+	int intext;                 /* whether the pointer is over the input field */
 };
 
 /* history */